@@ -0,0 +1,360 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "osmem.h"
+#include "helpers.h"
+
+/*
+ * Arenas let threads allocate without waiting for each other. Every arena has
+ * its own lock, heap and free index, and every thread sticks to the arena it
+ * was given on its first allocation, round-robin over as many arenas as there
+ * are CPUs. The first thread gets the main arena, whose heap grows with sbrk
+ * as it always did. The others get a heap of ARENA_HEAP_SIZE bytes from mmap,
+ * aligned to its size and starting with a pointer back to its arena, so a
+ * block outside the brk heap finds its arena by masking its address.
+ *
+ * Built with HEAP_MMAP, nothing calls sbrk anymore. The main arena gets a
+ * heap of MAIN_HEAP_SIZE bytes from mmap as well. Every heap is reserved with
+ * PROT_NONE and committed with mprotect by COMMIT_SIZE bytes at a time as
+ * its top grows.
+ *
+ * Built with NUMA, a thread takes an arena of the node it runs on, and heaps
+ * are bound to the node of the thread that maps or grows them.
+ *
+ * Built with THP, every mapped heap is given to madvise(MADV_HUGEPAGE), and is
+ * committed and purged by whole huge pages.
+ *
+ * A block freed by a thread that doesn't use its arena is pushed on the
+ * remote_frees list of the arena with a CAS instead of taking the lock. The
+ * threads of the arena take the whole list with a single exchange the next
+ * time they allocate from the heap, and free the blocks then.
+ */
+struct arena arenas[ARENA_MAX] = {
+	[0 ... ARENA_MAX - 1] = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.first_brk = 1,
+#ifdef GEOMETRIC_GROWTH
+		.grow_step = GROW_MIN,
+#endif
+	},
+};
+
+__thread struct arena *thread_arena;
+unsigned int next_arena;
+char *main_start;
+char *main_top;
+/* Start of the heap of every secondary arena, to tell heap blocks from mapped ones by their address */
+char *heap_bases[ARENA_MAX];
+
+#ifdef HEAP_MMAP
+#define HEAP_PROT PROT_NONE
+#else
+#define HEAP_PROT (PROT_READ | PROT_WRITE)
+#endif
+
+#ifdef HEAP_MMAP
+// Commit the pages of a heap up to the given address, 0 if mprotect fails
+char arena_commit(struct arena *arena, char *end)
+{
+	if (end <= arena->commit)
+		return 1;
+	size_t size = (end - arena->commit + COMMIT_SIZE - 1) & ~(COMMIT_SIZE - 1);
+
+	if (size > (size_t)(arena->limit - arena->commit))
+		size = arena->limit - arena->commit;
+	if (mprotect(arena->commit, size, PROT_READ | PROT_WRITE) == -1)
+		return 0;
+	arena->commit += size;
+	return 1;
+}
+#endif
+
+// Map a region of the given size, a multiple of the page size, that starts at a multiple of align, NULL if mmap fails
+char *map_aligned(size_t size, size_t align, int prot, int flags)
+{
+	char *map = mmap(NULL, size + align, prot, MAP_PRIVATE | MAP_ANON | flags, -1, 0);
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	// Only keep the part that is aligned
+	char *start = (char *)(((size_t)map + align - 1) & ~(align - 1));
+
+	if (start != map)
+		DIE(munmap(map, start - map) == -1, "munmap failed");
+	DIE(munmap(start + size, map + align - start) == -1, "munmap failed");
+	return start;
+}
+
+#ifdef THP
+// Map a block of the given size, header included, that starts on a huge page and may use huge pages
+void *map_huge(size_t blk_size)
+{
+	size_t page_size = sysconf(_SC_PAGE_SIZE);
+	size_t length = (blk_size + page_size - 1) & ~(page_size - 1);
+	char *map = map_aligned(length, HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, 0);
+
+	DIE(map == NULL, "mmap failed");
+#ifdef NUMA
+	numa_place(map, length);
+#endif
+	madvise(map, length, MADV_HUGEPAGE);
+	return map;
+}
+#endif
+
+// Map the heap of an arena, aligned to its size
+char arena_heap_init(struct arena *arena, size_t size)
+{
+	char *heap = map_aligned(size, size, HEAP_PROT, MAP_NORESERVE);
+
+	if (heap == NULL)
+		return 0;
+#ifdef NUMA
+	// Only the threads of the node that maps the heap use its arena
+	numa_bind(heap, size);
+#endif
+#ifdef THP
+	// Huge pages are used wherever the heap is committed, it is aligned to them already
+	madvise(heap, size, MADV_HUGEPAGE);
+#endif
+	arena->limit = heap + size;
+#ifdef HEAP_MMAP
+	arena->commit = heap;
+	if (arena_commit(arena, heap + sizeof(struct arena *)) == 0) {
+		DIE(munmap(heap, size) == -1, "munmap failed");
+		arena->limit = NULL;
+		return 0;
+	}
+#endif
+	*(struct arena **)heap = arena;
+	arena->top = heap + ALIGN(sizeof(struct arena *));
+	arena->fresh = arena->top;
+	if (ARENA_ID(arena))
+		__atomic_store_n(&heap_bases[ARENA_ID(arena)], heap, __ATOMIC_RELAXED);
+	return 1;
+}
+
+// Get the arena of the calling thread, picking one on its first allocation
+struct arena *arena_get(void)
+{
+	struct arena *arena = thread_arena;
+
+	if (arena)
+		return arena;
+	unsigned int n = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+
+	arena = &arenas[0];
+	if (n) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		if (cpus > ARENA_MAX)
+			cpus = ARENA_MAX;
+#ifdef NUMA
+		if (cpus > 1)
+			arena = &arenas[numa_arena(n, cpus)];
+#else
+		if (cpus > 1)
+			arena = &arenas[n % cpus];
+#endif
+	}
+	if (ARENA_ID(arena)) {
+		pthread_mutex_lock(&arena->lock);
+		char ready = arena->limit || arena_heap_init(arena, ARENA_HEAP_SIZE);
+
+		pthread_mutex_unlock(&arena->lock);
+		// Without a heap of its own, the thread shares the main arena
+		if (!ready)
+			arena = &arenas[0];
+	}
+	thread_arena = arena;
+	return arena;
+}
+
+// Get the arena that owns a heap block
+struct arena *arena_of(struct block_meta *header)
+{
+	char *start = __atomic_load_n(&main_start, __ATOMIC_RELAXED);
+	char *top = __atomic_load_n(&main_top, __ATOMIC_RELAXED);
+
+	if ((char *)header >= start && (char *)header < top)
+		return &arenas[0];
+	return *(struct arena **)((size_t)header & ~(ARENA_HEAP_SIZE - 1));
+}
+
+// Check if a pointer is inside the heap of an arena, without reading the memory it points to
+char heap_owns(void *ptr)
+{
+	char *start = __atomic_load_n(&main_start, __ATOMIC_RELAXED);
+	char *top = __atomic_load_n(&main_top, __ATOMIC_RELAXED);
+	char *base = (char *)((size_t)ptr & ~(ARENA_HEAP_SIZE - 1));
+
+	if ((char *)ptr >= start && (char *)ptr < top)
+		return 1;
+	if (base == NULL)
+		return 0;
+	for (size_t i = 1; i < ARENA_MAX; i++)
+		if (__atomic_load_n(&heap_bases[i], __ATOMIC_RELAXED) == base)
+			return 1;
+	return 0;
+}
+
+// Grow the heap of an arena like sbrk does, MAP_FAILED if a secondary heap is full
+void *arena_sbrk(struct arena *arena, size_t increment)
+{
+	char *old_top;
+
+#ifdef HEAP_MMAP
+	// The main heap is mapped on its first use, like the brk heap would be
+	if (ARENA_ID(arena) == 0 && arena->limit == NULL) {
+		DIE(arena_heap_init(arena, MAIN_HEAP_SIZE) == 0, "mmap failed");
+		__atomic_store_n(&main_top, arena->top, __ATOMIC_RELAXED);
+		__atomic_store_n(&main_start, arena->limit - MAIN_HEAP_SIZE, __ATOMIC_RELAXED);
+	}
+#else
+	if (ARENA_ID(arena) == 0) {
+		old_top = sbrk(increment);
+		DIE(old_top == MAP_FAILED, "sbrk failed");
+#ifdef NUMA
+		if (increment)
+			numa_bind(old_top, increment);
+#endif
+		if (main_start == NULL)
+			__atomic_store_n(&main_start, old_top, __ATOMIC_RELAXED);
+		// Whoever else moved brk may have used the rest of the page it left brk in
+		if (old_top != main_top) {
+			size_t page_size = sysconf(_SC_PAGE_SIZE);
+			char *page_end = (char *)(((size_t)old_top + page_size - 1) & ~(page_size - 1));
+
+			if (arena->fresh < page_end)
+				arena->fresh = page_end;
+		}
+		if (arena->fresh < old_top + increment)
+			arena->fresh = old_top + increment;
+		__atomic_store_n(&main_top, old_top + increment, __ATOMIC_RELAXED);
+		return old_top;
+	}
+#endif
+	if (increment > (size_t)(arena->limit - arena->top))
+		return MAP_FAILED;
+#ifdef HEAP_MMAP
+	if (arena_commit(arena, arena->top + increment) == 0)
+		return MAP_FAILED;
+#endif
+	old_top = arena->top;
+	arena->top += increment;
+	if (arena->fresh < arena->top)
+		arena->fresh = arena->top;
+#ifdef HEAP_MMAP
+	if (ARENA_ID(arena) == 0)
+		__atomic_store_n(&main_top, arena->top, __ATOMIC_RELAXED);
+#endif
+	return old_top;
+}
+
+// Grow the heap of an arena by at least the given increment, which is set to how much it grew by, MAP_FAILED if it is full
+void *arena_grow(struct arena *arena, size_t *increment)
+{
+#ifdef GEOMETRIC_GROWTH
+	// Growing by the whole step keeps a burst of allocations from calling sbrk for each of them
+	if (*increment <= arena->grow_step) {
+		void *old_top = arena_sbrk(arena, arena->grow_step);
+
+		if (old_top != MAP_FAILED) {
+			*increment = arena->grow_step;
+			if (arena->grow_step < GROW_MAX)
+				arena->grow_step *= 2;
+			return old_top;
+		}
+	}
+#endif
+	return arena_sbrk(arena, *increment);
+}
+
+// Get how many bytes at the start of a new heap block may not be zero, from the fresh mark its arena had before
+size_t dirty_bytes(char *fresh, struct block_meta *header, size_t size)
+{
+	char *payload = (char *)header + BLOCK_META_SIZE;
+
+	// Before the heap first grows there is no fresh mark to go by
+	if (fresh == NULL || payload + size <= fresh)
+		return size;
+	return payload < fresh ? (size_t)(fresh - payload) : 0;
+}
+
+// Shrink the heap of an arena from its top, giving its pages back to the kernel
+void arena_trim(struct arena *arena, size_t decrement)
+{
+#ifndef HEAP_MMAP
+	if (ARENA_ID(arena) == 0) {
+		char *old_top = sbrk(-decrement);
+
+		DIE(old_top == MAP_FAILED, "sbrk failed");
+		__atomic_store_n(&main_top, old_top - decrement, __ATOMIC_RELAXED);
+		return;
+	}
+#endif
+	arena_purge(arena->top - decrement, arena->top + sysconf(_SC_PAGE_SIZE) - 1);
+	arena->top -= decrement;
+#ifdef HEAP_MMAP
+	if (ARENA_ID(arena) == 0)
+		__atomic_store_n(&main_top, arena->top, __ATOMIC_RELAXED);
+#endif
+}
+
+// Give the whole pages between two addresses back to the kernel, 0 if there are none
+char arena_purge(void *start, void *end)
+{
+#ifdef THP
+	// Only whole huge pages, giving back part of one would split it
+	size_t page_size = HUGE_PAGE_SIZE;
+#else
+	size_t page_size = sysconf(_SC_PAGE_SIZE);
+#endif
+	size_t first = ((size_t)start + page_size - 1) & ~(page_size - 1);
+	size_t last = (size_t)end & ~(page_size - 1);
+
+	if (first >= last)
+		return 0;
+	DIE(madvise((void *)first, last - first, MADV_DONTNEED) == -1, "madvise failed");
+	return 1;
+}
+
+// Free a heap block of the given size, handing it to its arena without locking it if the thread uses another arena
+void arena_free(struct block_meta *header, size_t size)
+{
+	struct arena *arena = arena_of(header);
+
+	if (arena != thread_arena) {
+		struct block_meta *head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+
+		do {
+			FREE_NEXT(header) = head;
+		} while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, header, 1,
+						      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		return;
+	}
+#ifdef TCACHE
+	if (tcache_free(header, size))
+		return;
+#else
+	(void)size;
+#endif
+	pthread_mutex_lock(&arena->lock);
+	heap_free(arena, header);
+	pthread_mutex_unlock(&arena->lock);
+}
+
+// Free the blocks other threads handed to the arena, the arena must be locked
+void arena_drain(struct arena *arena)
+{
+	if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL)
+		return;
+	struct block_meta *header = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+
+	while (header) {
+		struct block_meta *next = FREE_NEXT(header);
+
+		heap_free(arena, header);
+		header = next;
+	}
+}
@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "osmem.h"
+#include "helpers.h"
+
+/*
+ * Batches of blocks of the same size. os_malloc_batch takes the lock of the
+ * arena once, and heap_alloc_batch carves the blocks from spans of the heap,
+ * each found with a single search or a single growth. os_free_batch sorts the
+ * blocks by address, so the blocks of an arena form a run that is freed under
+ * one lock, and blocks that follow each other on the heap are merged before
+ * they are coalesced with their neighbours. The headers are sorted in the
+ * array of the caller, as plain pointers, so its contents are undefined once
+ * os_free_batch returns. Slab objects and mapped blocks
+ * are allocated and freed one by one, like os_malloc and os_free do.
+ */
+
+// Sift a block down the heap of the first end blocks
+void sift_down(void **blocks, size_t root, size_t end)
+{
+	while (2 * root + 1 < end) {
+		size_t child = 2 * root + 1;
+
+		if (child + 1 < end && (size_t)blocks[child + 1] > (size_t)blocks[child])
+			child++;
+		if ((size_t)blocks[root] >= (size_t)blocks[child])
+			return;
+		void *tmp = blocks[root];
+
+		blocks[root] = blocks[child];
+		blocks[child] = tmp;
+		root = child;
+	}
+}
+
+// Sort blocks by address with a heapsort, which doesn't allocate anything
+void sort_blocks(void **blocks, size_t count)
+{
+	for (size_t i = count / 2; i-- > 0;)
+		sift_down(blocks, i, count);
+	for (size_t end = count; end > 1; end--) {
+		void *tmp = blocks[0];
+
+		blocks[0] = blocks[end - 1];
+		blocks[end - 1] = tmp;
+		sift_down(blocks, 0, end - 1);
+	}
+}
+
+size_t os_malloc_batch(size_t size, size_t n, void **out)
+{
+	size_t done = 0;
+
+	if (size == 0)
+		return 0;
+#ifdef SLAB
+	if (size <= SLAB_MAX_SIZE)
+		while (done < n && (out[done] = slab_alloc(size)))
+			done++;
+#endif
+	// Blocks over the threshold are mapped anyway, the heap only carves the others
+	if (done < n && ALIGN(size + BLOCK_META_SIZE) < heap_threshold()) {
+		struct arena *arena = arena_get();
+
+		pthread_mutex_lock(&arena->lock);
+		done += heap_alloc_batch(arena, size, n - done, out + done);
+		pthread_mutex_unlock(&arena->lock);
+	}
+	for (; done < n; done++) {
+		out[done] = os_malloc(size);
+		DIE(out[done] == NULL, "os_malloc failed");
+	}
+	return n;
+}
+
+void os_free_batch(void **ptrs, size_t n)
+{
+	size_t count = 0;
+
+	// The headers of heap blocks are kept at the front of the array, the other blocks are freed right away
+	for (size_t i = 0; i < n; i++) {
+		if (ptrs[i] == NULL)
+			continue;
+#ifdef SLAB
+		if (slab_owns(ptrs[i])) {
+			slab_free(ptrs[i]);
+			continue;
+		}
+#endif
+		struct block_meta *header = (struct block_meta *)((char *)ptrs[i] - BLOCK_META_SIZE);
+
+		if (GET_STATUS(header) != STATUS_ALLOC) {
+			os_free(ptrs[i]);
+			continue;
+		}
+		ptrs[count++] = header;
+	}
+	sort_blocks(ptrs, count);
+
+	// Every heap is a single range, so the blocks of an arena come in one run
+	for (size_t i = 0, j; i < count; i = j) {
+		struct arena *arena = arena_of(ptrs[i]);
+
+		for (j = i + 1; j < count && arena_of(ptrs[j]) == arena; j++)
+			;
+		pthread_mutex_lock(&arena->lock);
+		heap_free_batch(arena, ptrs + i, j - i);
+		pthread_mutex_unlock(&arena->lock);
+	}
+}
@@ -0,0 +1,299 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "osmem.h"
+#include "helpers.h"
+
+/*
+ * Binary buddy heap. Every heap block spans a power of two bytes, header
+ * included, and starts at an address aligned to its own span, so the buddy of
+ * a block is found by flipping a single address bit. The heap grows by chunks
+ * of the largest order, which are never merged with each other. Every arena
+ * has its own heap and free lists.
+ */
+#define MIN_ORDER	5
+#define MAX_ORDER	17
+#define BUDDY_CHUNK	(1UL << MAX_ORDER)
+
+/*
+ * Free blocks of PURGE_MIN_ORDER and up, the smallest that can hold a whole
+ * page, are dirty until heap_trim gives their pages back. The flag is kept
+ * right after their list links.
+ */
+#define PURGE_MIN_ORDER	12
+#define DIRTY(header)	(((size_t *)((char *)(header) + BLOCK_META_SIZE))[2])
+
+struct free_index {
+	struct block_meta *free_lists[MAX_ORDER + 1];
+	size_t order_map;
+};
+
+struct free_index indexes[ARENA_MAX];
+
+// Get the order of the smallest block that holds the given payload size
+size_t order_of(size_t size)
+{
+	size_t blk_size = size + BLOCK_META_SIZE;
+
+	if (blk_size <= (1UL << MIN_ORDER))
+		return MIN_ORDER;
+	return SIZE_BITS - __builtin_clzl(blk_size - 1);
+}
+
+// Get the order of a heap block
+size_t block_order(struct block_meta *header)
+{
+	return SIZE_BITS - 1 - __builtin_clzl(GET_SIZE(header) + BLOCK_META_SIZE);
+}
+
+// Add a free block to the front of the list of its order
+void buddy_insert(struct arena *arena, struct block_meta *header, size_t order)
+{
+	struct free_index *index = &indexes[ARENA_ID(arena)];
+
+	INIT_HEADER(header, (1UL << order) - BLOCK_META_SIZE, STATUS_FREE);
+	FREE_NEXT(header) = index->free_lists[order];
+	FREE_PREV(header) = NULL;
+	if (FREE_NEXT(header))
+		FREE_PREV(FREE_NEXT(header)) = header;
+	index->free_lists[order] = header;
+	index->order_map |= 1UL << order;
+	if (order >= PURGE_MIN_ORDER)
+		DIRTY(header) = 1;
+}
+
+// Remove a free block from the list of its order
+void buddy_remove(struct arena *arena, struct block_meta *header, size_t order)
+{
+	struct free_index *index = &indexes[ARENA_ID(arena)];
+	struct block_meta *prev = FREE_PREV(header);
+
+	if (FREE_NEXT(header))
+		FREE_PREV(FREE_NEXT(header)) = prev;
+	if (prev) {
+		FREE_NEXT(prev) = FREE_NEXT(header);
+		return;
+	}
+	index->free_lists[order] = FREE_NEXT(header);
+	if (index->free_lists[order] == NULL)
+		index->order_map &= ~(1UL << order);
+}
+
+// Get the buddy of a block with the given order, NULL if it is not a free block of the same order
+struct block_meta *free_buddy(struct block_meta *header, size_t order)
+{
+	struct block_meta *buddy = (struct block_meta *)((size_t)header ^ (1UL << order));
+
+	if (GET_STATUS(buddy) != STATUS_FREE || GET_SIZE(buddy) != (1UL << order) - BLOCK_META_SIZE)
+		return NULL;
+	return buddy;
+}
+
+// Give the upper halves of a block back until it has the requested order
+void buddy_split(struct arena *arena, struct block_meta *header, size_t order, size_t target)
+{
+	while (order > target) {
+		order--;
+		buddy_insert(arena, (struct block_meta *)((char *)header + (1UL << order)), order);
+	}
+	SET_SIZE(header, (1UL << target) - BLOCK_META_SIZE);
+}
+
+// Give the free chunks at the top of the heap back to the kernel, keeping pad bytes of them, if they hold threshold bytes more, 0 if none were given back
+char buddy_trim(struct arena *arena, size_t pad, size_t threshold)
+{
+	char *top = arena_sbrk(arena, 0);
+	size_t keep = (pad + BUDDY_CHUNK - 1) / BUDDY_CHUNK;
+	size_t count = 0;
+
+	// Only whole chunks the heap grew by are given back
+	if ((size_t)top & (BUDDY_CHUNK - 1) || arena->heap_start == NULL)
+		return 0;
+	while (1) {
+		struct block_meta *header = (struct block_meta *)(top - (count + 1) * BUDDY_CHUNK);
+
+		if (header < arena->heap_start || GET_STATUS(header) != STATUS_FREE || block_order(header) != MAX_ORDER)
+			break;
+		count++;
+	}
+	if (count <= keep || (count - keep) * BUDDY_CHUNK < threshold)
+		return 0;
+	for (size_t i = 0; i < count - keep; i++)
+		buddy_remove(arena, (struct block_meta *)(top - (i + 1) * BUDDY_CHUNK), MAX_ORDER);
+	arena_trim(arena, (count - keep) * BUDDY_CHUNK);
+	return 1;
+}
+
+// Give the pages inside a free block back to the kernel, keeping its list links and dirty flag
+char purge_block(struct block_meta *header)
+{
+	char *payload = (char *)header + BLOCK_META_SIZE;
+
+	return arena_purge(payload + 3 * sizeof(void *), payload + GET_SIZE(header));
+}
+
+// Free a heap block, merging it with its buddies while they are free, the arena must be locked
+void heap_free(struct arena *arena, struct block_meta *header)
+{
+	size_t order = block_order(header);
+
+	while (order < MAX_ORDER) {
+		struct block_meta *buddy = free_buddy(header, order);
+
+		if (buddy == NULL)
+			break;
+		buddy_remove(arena, buddy, order);
+		if (buddy < header)
+			header = buddy;
+		order++;
+	}
+	buddy_insert(arena, header, order);
+#ifdef AUTO_TRIM
+	// Whole free chunks at the top of the heap are given back to the kernel, down to the pad
+	if (order == MAX_ORDER)
+		buddy_trim(arena, top_pad_get(), trim_threshold_get());
+#endif
+}
+
+// Grow the heap by a chunk of the largest order, aligned to its size, NULL if the heap is full
+struct block_meta *buddy_grow(struct arena *arena)
+{
+	size_t pad = -(size_t)arena_sbrk(arena, 0) & (BUDDY_CHUNK - 1);
+	size_t increment = pad + BUDDY_CHUNK;
+	char *chunk = arena_grow(arena, &increment);
+
+	if (chunk == MAP_FAILED)
+		return NULL;
+	if (arena->heap_start == NULL)
+		arena->heap_start = (struct block_meta *)(chunk + pad);
+
+	// Any other whole chunk the heap grew by is free
+	for (size_t offset = pad + BUDDY_CHUNK; offset + BUDDY_CHUNK <= increment; offset += BUDDY_CHUNK)
+		buddy_insert(arena, (struct block_meta *)(chunk + offset), MAX_ORDER);
+	return (struct block_meta *)(chunk + pad);
+}
+
+// Take a block for the requested size from the heap of the arena, the arena must be locked
+struct block_meta *heap_alloc(struct arena *arena, size_t size)
+{
+	struct free_index *index = &indexes[ARENA_ID(arena)];
+	struct block_meta *header;
+
+	// Blocks other threads freed are taken back first, they may fit the request
+	arena_drain(arena);
+
+	// Take the smallest free block that fits and split it down to the requested order
+	size_t order = order_of(size);
+	size_t fits = index->order_map & (~0UL << order);
+
+	if (fits) {
+		size_t found = __builtin_ctzl(fits);
+
+		header = index->free_lists[found];
+		buddy_remove(arena, header, found);
+		buddy_split(arena, header, found, order);
+	} else {
+		header = buddy_grow(arena);
+		// The heap of a secondary arena is full, so the block is mapped instead
+		if (header == NULL)
+			return map_block(size);
+		buddy_split(arena, header, MAX_ORDER, order);
+	}
+	SET_STATUS(header, STATUS_ALLOC);
+	return header;
+}
+
+// Take a block whose payload is aligned to the given power of two from the heap of the arena, the arena must be locked
+struct block_meta *heap_memalign(struct arena *arena, size_t alignment, size_t size)
+{
+	// Blocks can't be split at any address, so a header in front of the aligned payload leads back to the block
+	size_t need = BLOCK_META_SIZE + alignment + size;
+
+	if (order_of(need) > MAX_ORDER)
+		return map_block_aligned(alignment, size);
+	struct block_meta *block = heap_alloc(arena, need);
+
+	// The heap of a secondary arena is full, so the block is mapped instead
+	if (GET_STATUS(block) == STATUS_MAPPED) {
+		unmap_block(block);
+		return map_block_aligned(alignment, size);
+	}
+	char *payload = (char *)(((size_t)block + 2 * BLOCK_META_SIZE + alignment - 1) & ~(alignment - 1));
+	struct block_meta *header = (struct block_meta *)(payload - BLOCK_META_SIZE);
+
+	INIT_HEADER(header, (char *)header - (char *)block, STATUS_ALIGNED);
+	return header;
+}
+
+// Take count blocks of the given size from the heap of the arena, the arena must be locked, returns how many were taken
+size_t heap_alloc_batch(struct arena *arena, size_t size, size_t count, void **out)
+{
+	// Blocks can't be carved at any address, so each one takes its own order under the same lock
+	if (order_of(size) > MAX_ORDER)
+		return 0;
+	for (size_t i = 0; i < count; i++)
+		out[i] = (char *)heap_alloc(arena, size) + BLOCK_META_SIZE;
+	return count;
+}
+
+// Free blocks sorted by address, the arena must be locked
+void heap_free_batch(struct arena *arena, void **blocks, size_t count)
+{
+	// Each block merges with its buddies as it is freed
+	for (size_t i = 0; i < count; i++)
+		heap_free(arena, blocks[i]);
+}
+
+// Get the size from which blocks are mapped, which can't be more than the largest heap block
+size_t heap_threshold(void)
+{
+	size_t threshold = mmap_threshold_get();
+
+	return threshold < MMAP_THRESHOLD ? threshold : MMAP_THRESHOLD;
+}
+
+// Give the free memory of a heap back to the kernel, the heap only shrinks by whole chunks so pad is rounded up to them
+char heap_trim(struct arena *arena, size_t pad)
+{
+	struct free_index *index = &indexes[ARENA_ID(arena)];
+	char released = buddy_trim(arena, pad, 0);
+
+	for (size_t order = PURGE_MIN_ORDER; order <= MAX_ORDER; order++)
+		for (struct block_meta *header = index->free_lists[order]; header; header = FREE_NEXT(header))
+			if (DIRTY(header)) {
+				DIRTY(header) = 0;
+				released |= purge_block(header);
+			}
+	return released;
+}
+
+// Check if a heap block can grow to the given order by taking in the free buddies above it
+char buddy_can_grow(struct block_meta *header, size_t order, size_t target)
+{
+	for (; order < target; order++) {
+		if ((size_t)header & (1UL << order))
+			return 0;
+		if (free_buddy(header, order) == NULL)
+			return 0;
+	}
+	return 1;
+}
+
+// Resize a heap block in place when its buddies allow it and it stays on the heap, the arena must be locked
+char heap_resize(struct arena *arena, struct block_meta *header, size_t size)
+{
+	size_t order = block_order(header);
+	size_t target = order_of(size);
+
+	if (ALIGN(size + BLOCK_META_SIZE) >= heap_threshold())
+		return 0;
+	if (target <= order) {
+		buddy_split(arena, header, order, target);
+		return 1;
+	}
+	if (buddy_can_grow(header, order, target) == 0)
+		return 0;
+	for (; order < target; order++)
+		buddy_remove(arena, free_buddy(header, order), order);
+	SET_SIZE(header, (1UL << target) - BLOCK_META_SIZE);
+	return 1;
+}
@@ -0,0 +1,557 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "osmem.h"
+#include "helpers.h"
+
+/*
+ * Heap of the list and tlsf engines. Blocks of any size are split from free
+ * blocks and merged back with their neighbours when they are freed, and the
+ * free blocks are indexed by the engine selected in the Makefile.
+ */
+
+/*
+ * Free blocks of at least PURGE_THRESHOLD bytes are dirty until the pages
+ * inside them are given back to the kernel. They wait on the dirty list of
+ * their arena, oldest first, and keep their place on it and the time they were
+ * freed right after their list links. Once they have been free for DECAY_MS,
+ * the next call into the heap purges them, so memory that is reused soon is
+ * never given back and memory that isn't stops costing anything. Smaller free
+ * blocks only use the time to tell whether heap_trim purged them already.
+ */
+#define DIRTY_NEXT(header)	(((struct block_meta **)((char *)(header) + BLOCK_META_SIZE))[2])
+#define DIRTY_PREV(header)	(((struct block_meta **)((char *)(header) + BLOCK_META_SIZE))[3])
+#define DIRTY_TIME(header)	(((size_t *)((char *)(header) + BLOCK_META_SIZE))[4])
+#define DIRTY_WORDS		5
+#define HAS_DIRTY_TIME(header)	(GET_SIZE(header) > DIRTY_WORDS * sizeof(void *))
+
+// Get a coarse monotonic time in milliseconds
+size_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Add a free block to the end of the dirty list, stamped with the current time
+void dirty_link(struct arena *arena, struct block_meta *header)
+{
+	DIRTY_NEXT(header) = NULL;
+	DIRTY_PREV(header) = arena->dirty_tail;
+	DIRTY_TIME(header) = now_ms();
+	if (arena->dirty_tail)
+		DIRTY_NEXT(arena->dirty_tail) = header;
+	else
+		__atomic_store_n(&arena->dirty_head, header, __ATOMIC_RELAXED);
+	arena->dirty_tail = header;
+#ifdef PURGER
+	purger_start();
+#endif
+}
+
+// Remove a free block from the dirty list, its time is 0 from then on
+void dirty_unlink(struct arena *arena, struct block_meta *header)
+{
+	if (DIRTY_NEXT(header))
+		DIRTY_PREV(DIRTY_NEXT(header)) = DIRTY_PREV(header);
+	else
+		arena->dirty_tail = DIRTY_PREV(header);
+	if (DIRTY_PREV(header))
+		DIRTY_NEXT(DIRTY_PREV(header)) = DIRTY_NEXT(header);
+	else
+		__atomic_store_n(&arena->dirty_head, DIRTY_NEXT(header), __ATOMIC_RELAXED);
+	DIRTY_TIME(header) = 0;
+}
+
+// Index a free block, it is dirty until it is purged
+void free_insert(struct arena *arena, struct block_meta *header)
+{
+	bin_insert(arena, header);
+	if (GET_SIZE(header) >= PURGE_THRESHOLD)
+		dirty_link(arena, header);
+	else if (HAS_DIRTY_TIME(header))
+		DIRTY_TIME(header) = 1;
+}
+
+// Take a block out of the free index and of the dirty list if it is still on it
+void free_remove(struct arena *arena, struct block_meta *header)
+{
+	bin_remove(arena, header);
+	if (GET_SIZE(header) >= PURGE_THRESHOLD && DIRTY_TIME(header))
+		dirty_unlink(arena, header);
+}
+
+// Get the block right after the given one on the heap, NULL for the last one
+struct block_meta *block_after(struct arena *arena, struct block_meta *header)
+{
+	if (header == arena->heap_end)
+		return NULL;
+	return (struct block_meta *)((char *)header + BLOCK_META_SIZE + GET_SIZE(header));
+}
+
+// Record in the next block whether the given one is free, so it can be found from there
+void set_boundary_tag(struct arena *arena, struct block_meta *header)
+{
+	struct block_meta *next = block_after(arena, header);
+
+	if (next == NULL)
+		return;
+#ifdef COMPACT_HEADER
+	if (GET_STATUS(header) != STATUS_FREE) {
+		next->size |= PREV_INUSE;
+		return;
+	}
+	next->size &= ~PREV_INUSE;
+	((struct block_meta **)next)[-1] = header;
+#else
+	if (header->status != STATUS_FREE) {
+		next->prev_free = 0;
+		return;
+	}
+	size_t distance = ((char *)next - (char *)header) / ALIGNMENT;
+
+	if (distance < PREV_FREE_FAR) {
+		next->prev_free = distance;
+	} else {
+		next->prev_free = PREV_FREE_FAR;
+		((struct block_meta **)next)[-1] = header;
+	}
+#endif
+}
+
+// Get the block before the given one if it is free
+struct block_meta *prev_free_block(struct block_meta *header)
+{
+#ifdef COMPACT_HEADER
+	if (header->size & PREV_INUSE)
+		return NULL;
+	return ((struct block_meta **)header)[-1];
+#else
+	if (header->prev_free == 0)
+		return NULL;
+	if (header->prev_free == PREV_FREE_FAR)
+		return ((struct block_meta **)header)[-1];
+	return (struct block_meta *)((char *)header - (size_t)header->prev_free * ALIGNMENT);
+#endif
+}
+
+// Coalesce all blocks that are free after the given block
+void coalesce_next(struct arena *arena, struct block_meta *start, size_t max_size_to_expand)
+{
+	struct block_meta *header = start;
+	struct block_meta *next = block_after(arena, header);
+
+	while (next != NULL) {
+		if (GET_STATUS(next) == STATUS_FREE) {
+			free_remove(arena, next);
+			SET_SIZE(header, GET_SIZE(header) + GET_SIZE(next) + BLOCK_META_SIZE);
+			if (next == arena->heap_end)
+				arena->heap_end = header;
+			next = block_after(arena, header);
+			if (GET_SIZE(header) >= max_size_to_expand)
+				break;
+		} else
+			break;
+	}
+	set_boundary_tag(arena, header);
+}
+
+// Free a heap block, merging it with the free blocks around it, and get the merged block
+struct block_meta *free_block(struct arena *arena, struct block_meta *header)
+{
+	struct block_meta *prev = prev_free_block(header);
+
+	SET_STATUS(header, STATUS_FREE);
+	coalesce_next(arena, header, LONG_MAX);
+	if (prev) {
+		free_remove(arena, prev);
+		SET_SIZE(prev, GET_SIZE(prev) + GET_SIZE(header) + BLOCK_META_SIZE);
+		if (header == arena->heap_end)
+			arena->heap_end = prev;
+		header = prev;
+		set_boundary_tag(arena, header);
+	}
+	free_insert(arena, header);
+	return header;
+}
+
+// Give the pages inside a free block back to the kernel, keeping its list links and boundary tag
+char purge_block(struct block_meta *header)
+{
+	char *payload = (char *)header + BLOCK_META_SIZE;
+
+	return arena_purge(payload + DIRTY_WORDS * sizeof(void *), payload + GET_SIZE(header) - sizeof(void *));
+}
+
+// Purge the dirty blocks that have been free for DECAY_MS, or all of them, the arena must be locked
+char decay_purge(struct arena *arena, char all)
+{
+	char released = 0;
+
+	if (arena->dirty_head == NULL)
+		return 0;
+	size_t now = now_ms();
+
+	while (arena->dirty_head && (all || DIRTY_TIME(arena->dirty_head) + DECAY_MS <= now)) {
+		struct block_meta *header = arena->dirty_head;
+
+		dirty_unlink(arena, header);
+		released |= purge_block(header);
+	}
+	return released;
+}
+
+// Shrink the free block at the top of the heap to pad bytes and give the rest back to the kernel
+char trim_top(struct arena *arena, size_t pad)
+{
+	struct block_meta *header = arena->heap_end;
+
+	if (header == NULL || GET_STATUS(header) != STATUS_FREE)
+		return 0;
+	size_t page_size = sysconf(_SC_PAGE_SIZE);
+	char *end = (char *)header + BLOCK_META_SIZE + GET_SIZE(header);
+	char *new_end = (char *)(((size_t)header + BLOCK_META_SIZE + PAYLOAD_SIZE(pad) + page_size - 1) &
+				 ~(page_size - 1));
+
+	// Nothing is given back if less than a page is left or something else grew the heap meanwhile
+	if (new_end + page_size > end || arena_sbrk(arena, 0) != end)
+		return 0;
+	free_remove(arena, header);
+	arena_trim(arena, end - new_end);
+	SET_SIZE(header, new_end - (char *)header - BLOCK_META_SIZE);
+	free_insert(arena, header);
+	return 1;
+}
+
+#ifdef FASTBINS
+/*
+ * Fast bins hold small blocks that were freed but are still marked as
+ * allocated, so nothing coalesces with them. Every bin holds a single size and
+ * is used as a stack, which makes freeing and reusing them a push and a pop.
+ * They are only merged back into the heap by consolidate.
+ */
+
+// Free the blocks held in the fast bins, merging them with their neighbours
+void consolidate(struct arena *arena)
+{
+	while (arena->fastbin_map) {
+		size_t idx = __builtin_ctzl(arena->fastbin_map);
+		struct block_meta *header = arena->fastbins[idx];
+
+		arena->fastbins[idx] = NULL;
+		arena->fastbin_map &= ~(1UL << idx);
+		while (header) {
+			struct block_meta *next = FREE_NEXT(header);
+
+			free_block(arena, header);
+			header = next;
+		}
+	}
+}
+#endif
+
+// Split the block into two blocks, one with the requested size and one with the remaining size
+void split(struct arena *arena, struct block_meta *header, size_t size)
+{
+	size_t blk_size = ALIGN(size + BLOCK_META_SIZE);
+	struct block_meta *new_header = (struct block_meta *)((char *)header + blk_size);
+
+	INIT_HEADER(new_header, GET_SIZE(header) - size - BLOCK_META_SIZE, STATUS_FREE);
+	if (header == arena->heap_end)
+		arena->heap_end = new_header;
+	free_block(arena, new_header);
+}
+
+// Allocate a new block at the top of the heap
+struct block_meta *alloc(struct arena *arena, size_t size)
+{
+	size_t payload_size = PAYLOAD_SIZE(size);
+	struct block_meta *header;
+
+	// If it's the first time allocating with sbrk, allocate at least MMAP_THRESHOLD size
+	size_t increment = BLOCK_META_SIZE + payload_size;
+
+	if (arena->first_brk && increment < MMAP_THRESHOLD)
+		increment = MMAP_THRESHOLD;
+	header = (struct block_meta *)arena_grow(arena, &increment);
+	// The heap of a secondary arena is full, so the block is mapped instead
+	if (header == MAP_FAILED)
+		return map_block(size);
+	INIT_HEADER(header, increment - BLOCK_META_SIZE, STATUS_ALLOC);
+	if (arena->heap_start == NULL)
+		arena->heap_start = header;
+	arena->heap_end = header;
+	arena->first_brk = 0;
+
+	// What the preallocation or the growth doesn't need becomes a free block, unless it is too small to split
+	if (GET_SIZE(header) - payload_size >= MIN_BLOCK_SIZE) {
+		split(arena, header, payload_size);
+		SET_SIZE(header, payload_size);
+	}
+	return header;
+}
+
+// Grow the heap so the block at its top gets the given payload size and is allocated, 0 if the heap is full
+char extend_top(struct arena *arena, struct block_meta *header, size_t size)
+{
+	size_t increment = size - GET_SIZE(header);
+
+	if (arena_grow(arena, &increment) == MAP_FAILED)
+		return 0;
+	if (GET_STATUS(header) == STATUS_FREE) {
+		free_remove(arena, header);
+		SET_STATUS(header, STATUS_ALLOC);
+	}
+	SET_SIZE(header, GET_SIZE(header) + increment);
+
+	// What the growth leaves over becomes the free block at the top of the heap
+	if (GET_SIZE(header) - size >= MIN_BLOCK_SIZE) {
+		split(arena, header, size);
+		SET_SIZE(header, size);
+	}
+	return 1;
+}
+
+// Take a block for the requested size from the heap of the arena, the arena must be locked
+struct block_meta *heap_alloc(struct arena *arena, size_t size)
+{
+	struct block_meta *header;
+	size_t alligned_size = PAYLOAD_SIZE(size);
+
+	// Blocks other threads freed are taken back first, they may fit the request
+	arena_drain(arena);
+	decay_purge(arena, 0);
+
+#ifdef FASTBINS
+	// A small block that was freed recently is reused as it is
+	if (alligned_size <= FASTBIN_MAX && arena->fastbins[alligned_size / ALIGNMENT - 1]) {
+		size_t idx = alligned_size / ALIGNMENT - 1;
+
+		header = arena->fastbins[idx];
+		arena->fastbins[idx] = FREE_NEXT(header);
+		if (arena->fastbins[idx] == NULL)
+			arena->fastbin_map &= ~(1UL << idx);
+		return header;
+	}
+#endif
+
+	// Find a free block that fits the requested size
+	header = find_fit(arena, alligned_size);
+#ifdef FASTBINS
+	// Merge the fast bins back only when the heap would otherwise grow
+	if (header == NULL && arena->fastbin_map) {
+		consolidate(arena);
+		header = find_fit(arena, alligned_size);
+	}
+#endif
+	if (header) {
+		free_remove(arena, header);
+		// Split the block if the remaining size is large enough to be a block of its own
+		size_t diff = GET_SIZE(header) - alligned_size;
+
+		if (diff >= MIN_BLOCK_SIZE) {
+			split(arena, header, alligned_size);
+			SET_SIZE(header, alligned_size);
+		}
+		SET_STATUS(header, STATUS_ALLOC);
+		set_boundary_tag(arena, header);
+	} else {
+		// If last block is free, extend it, otherwise allocate a new block
+		header = arena->heap_end;
+		if (header == NULL || GET_STATUS(header) != STATUS_FREE || extend_top(arena, header, alligned_size) == 0)
+			header = alloc(arena, size);
+	}
+	return header;
+}
+
+// Give a block back to the heap of the arena, the arena must be locked
+void heap_free(struct arena *arena, struct block_meta *header)
+{
+#ifdef FASTBINS
+	// Small blocks skip coalescing and wait in their fast bin
+	if (GET_SIZE(header) <= FASTBIN_MAX) {
+		size_t idx = GET_SIZE(header) / ALIGNMENT - 1;
+
+		FREE_NEXT(header) = arena->fastbins[idx];
+		arena->fastbins[idx] = header;
+		arena->fastbin_map |= 1UL << idx;
+		return;
+	}
+#endif
+	header = free_block(arena, header);
+
+#ifdef AUTO_TRIM
+	size_t pad = top_pad_get();
+
+	// A big free block at the top of the heap is given back right away by shrinking the heap down to the pad
+	if (header == arena->heap_end && GET_SIZE(header) >= trim_threshold_get() + pad)
+		trim_top(arena, pad);
+#endif
+	decay_purge(arena, 0);
+}
+
+// Take a block whose payload is aligned to the given power of two from the heap of the arena, the arena must be locked
+struct block_meta *heap_memalign(struct arena *arena, size_t alignment, size_t size)
+{
+	size_t alligned_size = PAYLOAD_SIZE(size);
+	// Enough room to slide the payload up to the alignment and leave a free block in front of it
+	struct block_meta *header = heap_alloc(arena, alligned_size + alignment + MIN_BLOCK_SIZE);
+
+	// The heap of a secondary arena is full, so the block is mapped instead
+	if (GET_STATUS(header) == STATUS_MAPPED) {
+		unmap_block(header);
+		return map_block_aligned(alignment, size);
+	}
+	char *payload = (char *)header + BLOCK_META_SIZE;
+	char *aligned = (char *)(((size_t)payload + alignment - 1) & ~(alignment - 1));
+
+	if (aligned != payload) {
+		struct block_meta *lead = header;
+
+		// The slack in front becomes a free block, so it has to be big enough for one
+		while ((size_t)(aligned - payload) < MIN_BLOCK_SIZE)
+			aligned += alignment;
+		header = (struct block_meta *)(aligned - BLOCK_META_SIZE);
+		INIT_HEADER(header, GET_SIZE(lead) - (aligned - payload), STATUS_ALLOC);
+		SET_SIZE(lead, (char *)header - payload);
+		if (lead == arena->heap_end)
+			arena->heap_end = header;
+		free_block(arena, lead);
+	}
+
+	// So does the slack after the payload
+	if (GET_SIZE(header) - alligned_size >= MIN_BLOCK_SIZE) {
+		split(arena, header, alligned_size);
+		SET_SIZE(header, alligned_size);
+	}
+	return header;
+}
+
+// Carve count blocks of the given size from spans of the heap, the arena must be locked, returns how many were carved
+size_t heap_alloc_batch(struct arena *arena, size_t size, size_t count, void **out)
+{
+	size_t payload_size = PAYLOAD_SIZE(size);
+	size_t blk_size = BLOCK_META_SIZE + payload_size;
+	size_t per_span = BATCH_SPAN / blk_size ? BATCH_SPAN / blk_size : 1;
+	size_t done = 0;
+
+	while (done < count) {
+		size_t batch = count - done < per_span ? count - done : per_span;
+		// A single search, or a single growth, finds room for the whole span
+		struct block_meta *span = heap_alloc(arena, batch * blk_size - BLOCK_META_SIZE);
+
+		// The heap of a secondary arena is full, so the blocks are left to be mapped one by one
+		if (GET_STATUS(span) == STATUS_MAPPED) {
+			unmap_block(span);
+			break;
+		}
+		char *end = (char *)span + BLOCK_META_SIZE + GET_SIZE(span);
+
+		for (size_t i = 0; i < batch; i++) {
+			struct block_meta *header = (struct block_meta *)((char *)span + i * blk_size);
+			// The last block keeps the slack of the span, which is too small to be a block of its own
+			size_t blk_payload = i + 1 < batch ? payload_size : (size_t)(end - (char *)header) - BLOCK_META_SIZE;
+
+			if (i)
+				INIT_HEADER(header, blk_payload, STATUS_ALLOC);
+			else
+				SET_SIZE(header, blk_payload);
+			out[done++] = (char *)header + BLOCK_META_SIZE;
+		}
+		if (arena->heap_end == span)
+			arena->heap_end = (struct block_meta *)((char *)span + (batch - 1) * blk_size);
+	}
+	return done;
+}
+
+// Free blocks sorted by address, the arena must be locked
+void heap_free_batch(struct arena *arena, void **blocks, size_t count)
+{
+	size_t i = 0;
+
+	while (i < count) {
+		struct block_meta *header = blocks[i++];
+
+		// A run of blocks that follow each other on the heap is merged first and coalesced with its neighbours once
+		while (i < count && blocks[i] == block_after(arena, header)) {
+			struct block_meta *next = blocks[i++];
+
+			if (next == arena->heap_end)
+				arena->heap_end = header;
+			SET_SIZE(header, GET_SIZE(header) + BLOCK_META_SIZE + GET_SIZE(next));
+		}
+		heap_free(arena, header);
+	}
+}
+
+// Give the free memory of a heap back to the kernel, keeping pad bytes at its top, the arena must be locked
+char heap_trim(struct arena *arena, size_t pad)
+{
+	char released = 0;
+
+#ifdef FASTBINS
+	consolidate(arena);
+#endif
+	released |= trim_top(arena, pad);
+	released |= decay_purge(arena, 1);
+	// Smaller free blocks are not on the dirty list, but may still hold whole pages
+	for (struct block_meta *header = arena->heap_start; header; header = block_after(arena, header))
+		if (GET_STATUS(header) == STATUS_FREE && GET_SIZE(header) < PURGE_THRESHOLD &&
+		    HAS_DIRTY_TIME(header) && DIRTY_TIME(header)) {
+			DIRTY_TIME(header) = 0;
+			released |= purge_block(header);
+		}
+	return released;
+}
+
+// Get the size from which blocks are mapped
+size_t heap_threshold(void)
+{
+	return mmap_threshold_get();
+}
+
+// Check if the block needs to be changed from sbrk to mmap or vice versa
+char changes_alloc_type(struct block_meta *header, size_t size)
+{
+	size_t blk_size = ALIGN(size + BLOCK_META_SIZE);
+
+	if (GET_STATUS(header) == STATUS_MAPPED && blk_size < mmap_threshold_get())
+		return 1;
+	if (GET_STATUS(header) == STATUS_ALLOC && blk_size >= mmap_threshold_get())
+		return 1;
+	return 0;
+}
+
+// Resize a heap block in place if it can stay on the heap, the arena must be locked
+char heap_resize(struct arena *arena, struct block_meta *header, size_t size)
+{
+	size_t old_size = GET_SIZE(header);
+	size_t alligned_size = PAYLOAD_SIZE(size);
+
+	// Check if the block doesn't need to change allocation type
+	if (changes_alloc_type(header, size))
+		return 0;
+
+	// If the new size is smaller than the old size, we might be able to split the block
+	if (old_size >= alligned_size) {
+		if (old_size - alligned_size >= MIN_BLOCK_SIZE) {
+			split(arena, header, alligned_size);
+			SET_SIZE(header, alligned_size);
+		}
+		return 1;
+	}
+
+	// Check if block is last block to do expanding
+	if (header == arena->heap_end && extend_top(arena, header, alligned_size))
+		return 1;
+
+	// Try to coalesce the block with the next ones
+	coalesce_next(arena, header, alligned_size);
+	if (GET_SIZE(header) < alligned_size)
+		return 0;
+	if (GET_SIZE(header) - alligned_size >= MIN_BLOCK_SIZE) {
+		split(arena, header, alligned_size);
+		SET_SIZE(header, alligned_size);
+	}
+	return 1;
+}
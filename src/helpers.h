@@ -4,11 +4,14 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #define DIE(assertion, call_description)						\
@@ -20,14 +23,248 @@
 		}									\
 	} while (0)
 
+/* Block metadata status values */
+#define STATUS_FREE   0
+#define STATUS_ALLOC  1
+#define STATUS_MAPPED 2
+/* Header in front of an aligned payload inside a buddy block, its size is the distance back to the block */
+#define STATUS_ALIGNED 3
+
+#ifdef COMPACT_HEADER
+
+/*
+ * Compact header, built with HEADER=compact: a single word holds the payload
+ * size in its high bits, the status in the two lowest bits and PREV_INUSE in
+ * the third one. Free blocks keep their list links in the first two words of
+ * the payload and their own address in the last one, which is where the next
+ * block looks for it while PREV_INUSE is clear.
+ */
+struct block_meta {
+	size_t size;
+};
+
+#define STATUS_MASK	3UL
+#define PREV_INUSE	4UL
+#define FLAG_MASK	((size_t)ALIGNMENT - 1)
+
+#define GET_SIZE(header)		((header)->size & ~FLAG_MASK)
+#define SET_SIZE(header, sz)		((header)->size = (sz) | ((header)->size & FLAG_MASK))
+#define GET_STATUS(header)		((int)((header)->size & STATUS_MASK))
+#define SET_STATUS(header, st)		((header)->size = ((header)->size & ~STATUS_MASK) | (st))
+#define INIT_HEADER(header, sz, st)	((header)->size = (sz) | (st) | PREV_INUSE)
+
+#define FREE_NEXT(header) (*(struct block_meta **)((char *)(header) + BLOCK_META_SIZE))
+#define FREE_PREV(header) (*(struct block_meta **)((char *)(header) + BLOCK_META_SIZE + sizeof(void *)))
+
+/* A mapped block has no block before it, so it clears PREV_INUSE while its pages are still zero */
+#define SET_ZEROED(header)	((header)->size &= ~PREV_INUSE)
+#define IS_ZEROED(header)	(GET_STATUS(header) == STATUS_MAPPED && !((header)->size & PREV_INUSE))
+
+#define MIN_PAYLOAD (3 * sizeof(void *))
+
+#else
+
 /* Structure to hold memory block metadata */
 struct block_meta {
 	size_t size;
 	int status;
+	unsigned int prev_free;
 	struct block_meta *next;
 };
 
-/* Block metadata status values */
-#define STATUS_FREE   0
-#define STATUS_ALLOC  1
-#define STATUS_MAPPED 2
+/*
+ * Boundary tag: prev_free holds the distance to the previous block on the heap
+ * in ALIGNMENT units while that block is free, and 0 while it is in use. When
+ * the distance does not fit, PREV_FREE_FAR is stored and the address of the
+ * previous block is kept in the last word of its payload instead.
+ */
+#define PREV_FREE_FAR UINT_MAX
+
+#define GET_SIZE(header)		((header)->size)
+#define SET_SIZE(header, sz)		((header)->size = (sz))
+#define GET_STATUS(header)		((header)->status)
+#define SET_STATUS(header, st)		((header)->status = (st))
+#define INIT_HEADER(header, sz, st)	((header)->size = (sz), (header)->status = (st), (header)->prev_free = 0)
+
+/*
+ * Free blocks form a doubly linked list per bin: next points to the following
+ * free block and the back link is kept in the first word of the payload.
+ */
+#define FREE_NEXT(header) ((header)->next)
+#define FREE_PREV(header) (*(struct block_meta **)((char *)(header) + BLOCK_META_SIZE))
+
+/* A mapped block has no boundary tag, so prev_free is set while its pages are still zero */
+#define SET_ZEROED(header)	((header)->prev_free = 1)
+#define IS_ZEROED(header)	(GET_STATUS(header) == STATUS_MAPPED && (header)->prev_free)
+
+#define MIN_PAYLOAD ALIGNMENT
+
+#endif
+
+/* Payload given to a heap block of the requested size, big enough to hold the links once it is freed */
+#define PAYLOAD_SIZE(size) (ALIGN(size) < MIN_PAYLOAD ? MIN_PAYLOAD : ALIGN(size))
+#define MIN_BLOCK_SIZE (BLOCK_META_SIZE + MIN_PAYLOAD)
+
+#define SIZE_BITS (sizeof(size_t) * CHAR_BIT)
+
+/* Fast bins of small freed blocks, built with FASTBINS=yes in the Makefile */
+#define FASTBIN_MAX	128
+#define FASTBIN_COUNT	(FASTBIN_MAX / ALIGNMENT)
+
+/*
+ * Arena: a heap with its own lock and free index. The main arena grows its
+ * heap with sbrk, the others get a heap of ARENA_HEAP_SIZE bytes from mmap.
+ * Built with HEAP_MMAP, the main arena gets a heap of MAIN_HEAP_SIZE bytes
+ * from mmap too, and heaps are committed COMMIT_SIZE bytes at a time.
+ * Big free blocks wait on the dirty list until their pages are purged. Blocks
+ * freed by threads that don't use the arena wait in remote_frees, on a cache
+ * line of its own, until a thread of the arena takes them back. Memory of a
+ * heap past fresh, the highest top it had, was never used, so it is still zero.
+ */
+#define ARENA_MAX	64
+#define ARENA_HEAP_SIZE	(64UL * 1024 * 1024)
+#define MAIN_HEAP_SIZE	(1024UL * 1024 * 1024)
+#define HUGE_PAGE_SIZE	(2UL * 1024 * 1024)
+#ifdef THP
+#define COMMIT_SIZE	HUGE_PAGE_SIZE
+#else
+#define COMMIT_SIZE	(128UL * 1024)
+#endif
+
+/*
+ * Built with AUTO_TRIM, a free block at the top of a heap is given back to the
+ * kernel once it is the trim threshold bigger than the top pad, and it keeps
+ * the top pad, so a block that is freed and taken again doesn't move the top of
+ * the heap every time. The pad starts at TOP_PAD and the trim threshold at
+ * TRIM_THRESHOLD, which then follows the mmap threshold, and both can be set
+ * with os_mallopt. The pages inside any other free block of at least
+ * PURGE_THRESHOLD bytes are given back once it has been free for DECAY_MS
+ * milliseconds, which can be set in the Makefile.
+ */
+#define TRIM_THRESHOLD	(128UL * 1024)
+#define TOP_PAD		(128UL * 1024)
+#define PURGE_THRESHOLD	(64UL * 1024)
+#ifndef DECAY_MS
+#define DECAY_MS	10000
+#endif
+
+/*
+ * Built with GEOMETRIC_GROWTH, a heap that has to grow takes at least
+ * grow_step bytes, which starts at GROW_MIN and doubles every time up to
+ * GROW_MAX. What the block doesn't need is left as the free block at the top
+ * of the heap, the wilderness, which the next blocks are split from.
+ */
+#define GROW_MIN	(128UL * 1024)
+#define GROW_MAX	(8UL * 1024 * 1024)
+
+struct arena {
+	pthread_mutex_t lock;
+	struct block_meta *heap_start;
+	struct block_meta *heap_end;
+	char first_brk;
+	char *top;
+	char *limit;
+	char *fresh;
+#ifdef GEOMETRIC_GROWTH
+	size_t grow_step;
+#endif
+#ifdef HEAP_MMAP
+	char *commit;
+#endif
+#ifdef FASTBINS
+	struct block_meta *fastbins[FASTBIN_COUNT];
+	size_t fastbin_map;
+#endif
+	struct block_meta *dirty_head;
+	struct block_meta *dirty_tail;
+	struct block_meta *remote_frees __attribute__((aligned(64)));
+};
+
+extern struct arena arenas[ARENA_MAX];
+
+#define ARENA_ID(arena) ((size_t)((arena) - arenas))
+
+struct arena *arena_get(void);
+struct arena *arena_of(struct block_meta *header);
+void *arena_sbrk(struct arena *arena, size_t increment);
+void *arena_grow(struct arena *arena, size_t *increment);
+void arena_free(struct block_meta *header, size_t size);
+char heap_owns(void *ptr);
+void arena_drain(struct arena *arena);
+void arena_trim(struct arena *arena, size_t decrement);
+void *map_huge(size_t blk_size);
+char arena_purge(void *start, void *end);
+size_t dirty_bytes(char *fresh, struct block_meta *header, size_t size);
+
+/* Heap of an arena, implemented by heap.c or buddy.c, called with the arena locked except heap_threshold */
+struct block_meta *heap_alloc(struct arena *arena, size_t size);
+void heap_free(struct arena *arena, struct block_meta *header);
+char heap_resize(struct arena *arena, struct block_meta *header, size_t size);
+char heap_trim(struct arena *arena, size_t pad);
+size_t heap_threshold(void);
+
+/* Blocks that are not kept on a heap, implemented by osmem.c */
+struct block_meta *map_block(size_t size);
+
+/*
+ * Batches of blocks, the heap part is implemented by heap.c or buddy.c. A
+ * batch is carved from spans of at most BATCH_SPAN bytes, each taken from the
+ * heap at once.
+ */
+#define BATCH_SPAN	(8UL * 1024 * 1024)
+
+size_t heap_alloc_batch(struct arena *arena, size_t size, size_t count, void **out);
+void heap_free_batch(struct arena *arena, void **blocks, size_t count);
+
+/* Blocks with an aligned payload, the heap part is implemented by heap.c or buddy.c */
+struct block_meta *heap_memalign(struct arena *arena, size_t alignment, size_t size);
+struct block_meta *map_block_aligned(size_t alignment, size_t size);
+void unmap_block(struct block_meta *header);
+struct block_meta *aligned_block(struct block_meta *header);
+
+/* Purging of dirty free blocks, implemented by heap.c */
+char decay_purge(struct arena *arena, char all);
+
+/* Tunables, implemented by mallopt.c. The dynamic threshold stops at MMAP_THRESHOLD_MAX */
+#define MMAP_THRESHOLD_MAX	(32UL * 1024 * 1024)
+
+size_t mmap_threshold_get(void);
+size_t top_pad_get(void);
+size_t trim_threshold_get(void);
+void mmap_threshold_update(struct block_meta *header);
+
+/* NUMA placement, built with NUMA=yes in the Makefile */
+extern size_t interleave_threshold;
+
+unsigned int numa_nodes(void);
+void numa_bind(void *start, size_t length);
+void numa_place(void *start, size_t length);
+size_t numa_arena(unsigned int n, size_t count);
+
+/* Cache of freed mappings, built with MAPCACHE=yes in the Makefile */
+struct block_meta *mapcache_get(size_t blk_size);
+char mapcache_put(struct block_meta *header);
+
+/* Background purger, built with PURGER=yes in the Makefile */
+void purger_start(void);
+
+/* Index of free blocks, implemented by the engine selected in the Makefile */
+void bin_insert(struct arena *arena, struct block_meta *header);
+void bin_remove(struct arena *arena, struct block_meta *header);
+struct block_meta *find_fit(struct arena *arena, size_t size);
+
+/* Slab layer for small objects, built with SLAB=yes in the Makefile */
+#define SLAB_MAX_SIZE 1024
+
+void *slab_alloc(size_t size);
+void slab_free(void *ptr);
+char slab_owns(void *ptr);
+size_t slab_size(void *ptr);
+
+/* Per-thread cache of small heap blocks, built with TCACHE=yes in the Makefile */
+struct block_meta *tcache_alloc(size_t size);
+char tcache_free(struct block_meta *header, size_t size);
+
+/* Per-CPU cache of small heap blocks, built with PCACHE=yes in the Makefile */
+struct block_meta *pcache_alloc(size_t size);
+char pcache_free(struct block_meta *header, size_t size);
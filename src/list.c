@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "osmem.h"
+#include "helpers.h"
+
+/*
+ * Free blocks are indexed in size-class bins. Sizes up to SMALL_BIN_MAX get one
+ * bin per ALIGNMENT step, bigger sizes get BIN_SUBCLASSES linear bins for each
+ * power of two. A bitmap tracks which bins are not empty. Every block in a
+ * small bin has the same size, so they are kept LIFO and the first one is
+ * taken. Only the big bins are kept sorted by address, unless FREELIST_LIFO.
+ */
+#define SMALL_BIN_LOG2		10
+#define SMALL_BIN_MAX		(1UL << SMALL_BIN_LOG2)
+#define SMALL_BINS		(SMALL_BIN_MAX / ALIGNMENT)
+#define BIN_SUBCLASS_LOG2	2
+#define BIN_SUBCLASSES		(1UL << BIN_SUBCLASS_LOG2)
+#define NUM_BINS		(SMALL_BINS + (SIZE_BITS - SMALL_BIN_LOG2) * BIN_SUBCLASSES)
+#define BIN_MAP_WORDS		((NUM_BINS + SIZE_BITS - 1) / SIZE_BITS)
+
+/* Every arena has its own bins */
+struct free_index {
+	struct block_meta *bins[NUM_BINS];
+	size_t bin_map[BIN_MAP_WORDS];
+};
+
+struct free_index indexes[ARENA_MAX];
+
+// Get the bin that holds free blocks of the given aligned size
+size_t bin_index(size_t size)
+{
+	if (size <= SMALL_BIN_MAX)
+		return size / ALIGNMENT - 1;
+	size_t fl = SIZE_BITS - 1 - __builtin_clzl(size);
+	size_t sl = (size >> (fl - BIN_SUBCLASS_LOG2)) & (BIN_SUBCLASSES - 1);
+
+	return SMALL_BINS + (fl - SMALL_BIN_LOG2) * BIN_SUBCLASSES + sl;
+}
+
+// Add a free block to its bin, at the front or keeping a big bin sorted by address
+void bin_insert(struct arena *arena, struct block_meta *header)
+{
+	struct free_index *index = &indexes[ARENA_ID(arena)];
+	size_t idx = bin_index(GET_SIZE(header));
+	struct block_meta *prev = NULL;
+	struct block_meta *next = index->bins[idx];
+
+#ifndef FREELIST_LIFO
+	while (idx >= SMALL_BINS && next != NULL && next < header) {
+		prev = next;
+		next = FREE_NEXT(next);
+	}
+#endif
+	FREE_NEXT(header) = next;
+	FREE_PREV(header) = prev;
+	if (next)
+		FREE_PREV(next) = header;
+	if (prev)
+		FREE_NEXT(prev) = header;
+	else
+		index->bins[idx] = header;
+	index->bin_map[idx / SIZE_BITS] |= 1UL << (idx % SIZE_BITS);
+}
+
+// Remove a free block from its bin
+void bin_remove(struct arena *arena, struct block_meta *header)
+{
+	struct free_index *index = &indexes[ARENA_ID(arena)];
+	size_t idx = bin_index(GET_SIZE(header));
+	struct block_meta *prev = FREE_PREV(header);
+
+	if (FREE_NEXT(header))
+		FREE_PREV(FREE_NEXT(header)) = prev;
+	if (prev) {
+		FREE_NEXT(prev) = FREE_NEXT(header);
+		return;
+	}
+	index->bins[idx] = FREE_NEXT(header);
+	if (index->bins[idx] == NULL)
+		index->bin_map[idx / SIZE_BITS] &= ~(1UL << (idx % SIZE_BITS));
+}
+
+// Find the first non-empty bin starting with the given one, NUM_BINS if there is none
+size_t next_bin(struct free_index *index, size_t idx)
+{
+	while (idx < NUM_BINS) {
+		size_t word = index->bin_map[idx / SIZE_BITS] >> (idx % SIZE_BITS);
+
+		if (word)
+			return idx + __builtin_ctzl(word);
+		idx = (idx / SIZE_BITS + 1) * SIZE_BITS;
+	}
+	return NUM_BINS;
+}
+
+// Find the smallest free block that fits the requested size
+struct block_meta *find_fit(struct arena *arena, size_t size)
+{
+	struct free_index *index = &indexes[ARENA_ID(arena)];
+	size_t idx = bin_index(size);
+	struct block_meta *min_header = NULL;
+
+	// Only the bin of the requested size can hold blocks that are too small,
+	// any block in a later bin fits and is bigger than the ones before it
+	while (min_header == NULL) {
+		idx = next_bin(index, idx);
+		if (idx == NUM_BINS)
+			return NULL;
+		// Every block of a small bin has the same size and fits
+		if (idx < SMALL_BINS)
+			return index->bins[idx];
+
+		// Bins are sorted by address, so the first block of the minimum size wins
+		for (struct block_meta *header = index->bins[idx]; header != NULL; header = FREE_NEXT(header))
+			if (GET_SIZE(header) >= size && (min_header == NULL || GET_SIZE(header) < GET_SIZE(min_header)))
+				min_header = header;
+		idx++;
+	}
+	return min_header;
+}
@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "osmem.h"
+#include "helpers.h"
+
+/*
+ * Tunables of the allocator. Blocks of at least mmap_threshold bytes, header
+ * included, are mapped. Built with DYNAMIC_THRESHOLD, the threshold follows
+ * the workload like the one of glibc: a mapped block that is freed raises it
+ * to just above its own size, up to mmap_threshold_max, so the next blocks of
+ * that size come from the heap, where they are reused, instead of being mapped
+ * and unmapped every time. Setting the threshold with os_mallopt fixes it.
+ * Like glibc, the trim threshold follows the mmap threshold at twice its
+ * value, so the heap doesn't shrink under the blocks the raised threshold
+ * keeps on it, until the trim threshold is set with os_mallopt.
+ */
+size_t mmap_threshold = MMAP_THRESHOLD;
+size_t mmap_threshold_max = MMAP_THRESHOLD_MAX;
+#ifdef DYNAMIC_THRESHOLD
+char threshold_dynamic = 1;
+#else
+char threshold_dynamic;
+#endif
+
+/* Built with AUTO_TRIM, free memory at the top of a heap that is kept when the heap shrinks, and how much more it takes to shrink it */
+size_t top_pad = TOP_PAD;
+size_t trim_threshold = TRIM_THRESHOLD;
+char trim_dynamic = 1;
+
+/* Built with NUMA, mapped blocks of at least interleave_threshold bytes are spread over all nodes, 0 turns it off */
+size_t interleave_threshold;
+
+// Get the size from which blocks are mapped
+size_t mmap_threshold_get(void)
+{
+	return __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+}
+
+// Get how many free bytes at the top of a heap are kept when it shrinks on its own
+size_t top_pad_get(void)
+{
+	return __atomic_load_n(&top_pad, __ATOMIC_RELAXED);
+}
+
+// Get how many free bytes over the top pad make a heap shrink on its own
+size_t trim_threshold_get(void)
+{
+	return __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED);
+}
+
+// Set the mmap threshold, and the trim threshold to twice it while it follows the mmap threshold
+void mmap_threshold_set(size_t threshold)
+{
+	__atomic_store_n(&mmap_threshold, threshold, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&trim_dynamic, __ATOMIC_RELAXED))
+		__atomic_store_n(&trim_threshold, 2 * threshold, __ATOMIC_RELAXED);
+}
+
+// Raise the threshold above a mapped block that is freed, while it follows the workload
+void mmap_threshold_update(struct block_meta *header)
+{
+	size_t blk_size = GET_SIZE(header) + BLOCK_META_SIZE;
+
+	if (__atomic_load_n(&threshold_dynamic, __ATOMIC_RELAXED) == 0)
+		return;
+	if (blk_size >= mmap_threshold_get() && blk_size < __atomic_load_n(&mmap_threshold_max, __ATOMIC_RELAXED))
+		mmap_threshold_set(ALIGN(blk_size + 1));
+}
+
+// Set a tunable, 0 if the parameter or the value is not valid
+int os_mallopt(int param, size_t value)
+{
+	switch (param) {
+	case OS_M_MMAP_THRESHOLD:
+		if (value == 0 || value > __atomic_load_n(&mmap_threshold_max, __ATOMIC_RELAXED))
+			return 0;
+		__atomic_store_n(&threshold_dynamic, 0, __ATOMIC_RELAXED);
+		mmap_threshold_set(ALIGN(value));
+		return 1;
+	case OS_M_MMAP_THRESHOLD_MAX:
+		if (value < mmap_threshold_get())
+			return 0;
+		__atomic_store_n(&mmap_threshold_max, value, __ATOMIC_RELAXED);
+		return 1;
+	case OS_M_TOP_PAD:
+		__atomic_store_n(&top_pad, value, __ATOMIC_RELAXED);
+		return 1;
+	case OS_M_TRIM_THRESHOLD:
+		__atomic_store_n(&trim_dynamic, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&trim_threshold, value, __ATOMIC_RELAXED);
+		return 1;
+#ifdef NUMA
+	case OS_M_INTERLEAVE_THRESHOLD:
+		__atomic_store_n(&interleave_threshold, value, __ATOMIC_RELAXED);
+		return 1;
+#endif
+	}
+	return 0;
+}
+
+// Fill in the current tunables, the number of bytes held by the heaps and the number of NUMA nodes
+void os_malloc_stats(struct os_malloc_stats *stats)
+{
+	stats->mmap_threshold = mmap_threshold_get();
+	stats->mmap_threshold_max = __atomic_load_n(&mmap_threshold_max, __ATOMIC_RELAXED);
+	stats->dynamic_threshold = __atomic_load_n(&threshold_dynamic, __ATOMIC_RELAXED);
+	stats->heap_bytes = 0;
+#ifdef NUMA
+	stats->numa_nodes = numa_nodes();
+#else
+	stats->numa_nodes = 1;
+#endif
+	stats->interleave_threshold = __atomic_load_n(&interleave_threshold, __ATOMIC_RELAXED);
+	stats->top_pad = top_pad_get();
+	stats->trim_threshold = trim_threshold_get();
+	for (size_t i = 0; i < ARENA_MAX; i++) {
+		struct arena *arena = &arenas[i];
+
+		pthread_mutex_lock(&arena->lock);
+		if (arena->heap_start)
+			stats->heap_bytes += (char *)arena_sbrk(arena, 0) - (char *)arena->heap_start;
+		pthread_mutex_unlock(&arena->lock);
+	}
+}
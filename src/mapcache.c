@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "osmem.h"
+#include "helpers.h"
+
+/*
+ * Cache of freed mappings. A mapped block that is freed keeps its mapping in
+ * the bucket of its length, one bucket for every power of two, and the next
+ * block that needs a mapping of about that length takes it instead of calling
+ * mmap. A block gets the whole length of the mapping it reuses, so it is
+ * unmapped in full once it leaves the cache. The cache holds up to
+ * MAPCACHE_SLOTS mappings of each bucket and MAPCACHE_BYTES bytes in total,
+ * anything else is unmapped as before. Built with MAPCACHE_FREE, cached
+ * mappings are given to madvise(MADV_FREE), so the kernel can take their pages
+ * back under memory pressure while the ones it doesn't take are reused as they
+ * are.
+ */
+#define MAPCACHE_MIN_LOG2	12
+#define MAPCACHE_MAX_LOG2	26
+#define MAPCACHE_BUCKETS	(MAPCACHE_MAX_LOG2 - MAPCACHE_MIN_LOG2 + 1)
+#define MAPCACHE_SLOTS		4
+#define MAPCACHE_BYTES		(64UL * 1024 * 1024)
+
+struct mapcache_bucket {
+	struct block_meta *maps[MAPCACHE_SLOTS];
+	size_t lengths[MAPCACHE_SLOTS];
+	unsigned int count;
+};
+
+struct mapcache_bucket mapcache[MAPCACHE_BUCKETS];
+size_t mapcache_bytes;
+pthread_mutex_t mapcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Get the length of the mapping that holds a block of the given size, header included
+size_t map_length(size_t blk_size)
+{
+	size_t page_size = sysconf(_SC_PAGE_SIZE);
+
+	return (blk_size + page_size - 1) & ~(page_size - 1);
+}
+
+// Get the bucket of mappings with the given length, -1 if they are not cached
+int mapcache_bucket(size_t length)
+{
+	int log2 = SIZE_BITS - 1 - __builtin_clzl(length);
+
+	if (log2 < MAPCACHE_MIN_LOG2 || log2 > MAPCACHE_MAX_LOG2)
+		return -1;
+	return log2 - MAPCACHE_MIN_LOG2;
+}
+
+// Take a mapping out of a bucket
+struct block_meta *mapcache_take(struct mapcache_bucket *bucket, unsigned int slot, size_t *length)
+{
+	struct block_meta *header = bucket->maps[slot];
+
+	*length = bucket->lengths[slot];
+	bucket->count--;
+	bucket->maps[slot] = bucket->maps[bucket->count];
+	bucket->lengths[slot] = bucket->lengths[bucket->count];
+	mapcache_bytes -= *length;
+	return header;
+}
+
+// Reuse a cached mapping for a block of the given size, NULL if none fits
+struct block_meta *mapcache_get(size_t blk_size)
+{
+	size_t length = map_length(blk_size);
+	int idx = mapcache_bucket(length);
+	struct block_meta *header = NULL;
+
+	if (idx < 0)
+		return NULL;
+	pthread_mutex_lock(&mapcache_lock);
+
+	// The smallest mapping of the same bucket that fits, or one of the next bucket up to twice the length
+	struct mapcache_bucket *bucket = &mapcache[idx];
+	unsigned int best = MAPCACHE_SLOTS;
+
+	for (unsigned int i = 0; i < bucket->count; i++)
+		if (bucket->lengths[i] >= length && (best == MAPCACHE_SLOTS || bucket->lengths[i] < bucket->lengths[best]))
+			best = i;
+	if (best == MAPCACHE_SLOTS && idx + 1 < MAPCACHE_BUCKETS) {
+		bucket = &mapcache[idx + 1];
+		for (unsigned int i = 0; i < bucket->count; i++)
+			if (bucket->lengths[i] <= 2 * length && (best == MAPCACHE_SLOTS || bucket->lengths[i] < bucket->lengths[best]))
+				best = i;
+	}
+	if (best != MAPCACHE_SLOTS)
+		header = mapcache_take(bucket, best, &length);
+	pthread_mutex_unlock(&mapcache_lock);
+
+	if (header)
+		INIT_HEADER(header, length - BLOCK_META_SIZE, STATUS_MAPPED);
+	return header;
+}
+
+// Keep the mapping of a freed mapped block for later, 0 if it has to be unmapped
+char mapcache_put(struct block_meta *header)
+{
+	size_t length = map_length(GET_SIZE(header) + BLOCK_META_SIZE);
+	int idx = mapcache_bucket(length);
+
+	// Blocks with an aligned payload don't start their mapping
+	if (idx < 0 || ((size_t)header & (sysconf(_SC_PAGE_SIZE) - 1)))
+		return 0;
+#ifdef MAPCACHE_FREE
+	// Before the mapping is in the cache, another thread could reuse it right away otherwise
+	madvise(header, length, MADV_FREE);
+#endif
+	pthread_mutex_lock(&mapcache_lock);
+	struct mapcache_bucket *bucket = &mapcache[idx];
+
+	if (bucket->count == MAPCACHE_SLOTS || mapcache_bytes + length > MAPCACHE_BYTES) {
+		pthread_mutex_unlock(&mapcache_lock);
+		return 0;
+	}
+	bucket->maps[bucket->count] = header;
+	bucket->lengths[bucket->count] = length;
+	bucket->count++;
+	mapcache_bytes += length;
+	pthread_mutex_unlock(&mapcache_lock);
+	return 1;
+}
@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "osmem.h"
+#include "helpers.h"
+
+/*
+ * Aligned allocation. Heap blocks are taken with enough room to slide their
+ * payload up to the alignment, and the engine gives back the slack on both
+ * sides in heap_memalign. Blocks that would be mapped anyway are mapped with
+ * room for the alignment, and the whole pages in front of their header and
+ * after their payload are unmapped right away. Such a header is not always at
+ * the start of a page, so mapped blocks are unmapped from the page they start
+ * in.
+ */
+
+// Map a block whose payload is aligned to the given power of two
+struct block_meta *map_block_aligned(size_t alignment, size_t size)
+{
+	size_t page_size = sysconf(_SC_PAGE_SIZE);
+	size_t length = (BLOCK_META_SIZE + alignment + ALIGN(size) + page_size - 1) & ~(page_size - 1);
+	char *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+
+	DIE(map == MAP_FAILED, "mmap failed");
+	char *payload = (char *)(((size_t)map + BLOCK_META_SIZE + alignment - 1) & ~(alignment - 1));
+	char *start = (char *)((size_t)(payload - BLOCK_META_SIZE) & ~(page_size - 1));
+	char *end = (char *)(((size_t)payload + ALIGN(size) + page_size - 1) & ~(page_size - 1));
+
+	if (start != map)
+		DIE(munmap(map, start - map) == -1, "munmap failed");
+	if (end != map + length)
+		DIE(munmap(end, map + length - end) == -1, "munmap failed");
+#ifdef NUMA
+	numa_place(start, end - start);
+#endif
+	struct block_meta *header = (struct block_meta *)(payload - BLOCK_META_SIZE);
+
+	INIT_HEADER(header, ALIGN(size), STATUS_MAPPED);
+	SET_ZEROED(header);
+	return header;
+}
+
+// Unmap a mapped block from the start of the page its header is in
+void unmap_block(struct block_meta *header)
+{
+	size_t page_size = sysconf(_SC_PAGE_SIZE);
+	char *start = (char *)((size_t)header & ~(page_size - 1));
+	char *end = (char *)header + BLOCK_META_SIZE + GET_SIZE(header);
+
+	DIE(munmap(start, end - start) == -1, "munmap failed");
+}
+
+// Get the block an aligned payload is in
+struct block_meta *aligned_block(struct block_meta *header)
+{
+	return (struct block_meta *)((char *)header - GET_SIZE(header));
+}
+
+void *os_memalign(size_t alignment, size_t size)
+{
+	if (size == 0)
+		return NULL;
+	if (alignment == 0 || (alignment & (alignment - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (alignment <= ALIGNMENT)
+		return os_malloc(size);
+	if (size > SIZE_MAX - alignment - 2 * MIN_BLOCK_SIZE) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	struct block_meta *header;
+
+	// Blocks that don't fit under the mmap threshold with their slack are mapped
+	if (ALIGN(size + BLOCK_META_SIZE) + alignment + MIN_BLOCK_SIZE >= heap_threshold()) {
+		header = map_block_aligned(alignment, size);
+	} else {
+		struct arena *arena = arena_get();
+
+		pthread_mutex_lock(&arena->lock);
+		header = heap_memalign(arena, alignment, size);
+		pthread_mutex_unlock(&arena->lock);
+	}
+	return (void *)((char *)header + BLOCK_META_SIZE);
+}
+
+void *os_aligned_alloc(size_t alignment, size_t size)
+{
+	return os_memalign(alignment, size);
+}
+
+int os_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	if (alignment == 0 || alignment % sizeof(void *) || (alignment & (alignment - 1)))
+		return EINVAL;
+	if (size == 0) {
+		*memptr = NULL;
+		return 0;
+	}
+	void *ptr = os_memalign(alignment, size);
+
+	if (ptr == NULL)
+		return ENOMEM;
+	*memptr = ptr;
+	return 0;
+}
@@ -0,0 +1,98 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "osmem.h"
+#include "helpers.h"
+
+/*
+ * NUMA placement. A thread takes an arena of the node it runs on, and the heap
+ * of the arena is bound to that node with mbind when the thread maps it, or as
+ * it grows for the brk heap. Mapped blocks are bound to the node of the thread
+ * that maps them, unless they are at least interleave_threshold bytes, which
+ * spreads them over all the nodes the process may use. Binding prefers the
+ * node instead of forcing it, so a full node falls back to the others instead
+ * of failing. On a single node, or a kernel without NUMA, nothing is bound and
+ * arenas are picked as before.
+ */
+#define NUMA_MAX_NODES	(sizeof(unsigned long) * CHAR_BIT)
+
+unsigned long numa_allowed;
+unsigned int numa_count;
+unsigned int numa_next[NUMA_MAX_NODES];
+
+// Get how many nodes there are, counting up to the highest one the process may use
+unsigned int numa_nodes(void)
+{
+	unsigned int count = __atomic_load_n(&numa_count, __ATOMIC_RELAXED);
+	unsigned long mask = 0;
+
+	if (count)
+		return count;
+	if (syscall(SYS_get_mempolicy, NULL, &mask, NUMA_MAX_NODES, NULL, MPOL_F_MEMS_ALLOWED) == -1 || mask == 0)
+		mask = 1;
+	count = SIZE_BITS - __builtin_clzl(mask);
+	__atomic_store_n(&numa_allowed, mask, __ATOMIC_RELAXED);
+	__atomic_store_n(&numa_count, count, __ATOMIC_RELAXED);
+	return count;
+}
+
+// Get the node the calling thread runs on
+unsigned int numa_node(void)
+{
+	unsigned int cpu, node;
+
+	if (getcpu(&cpu, &node) == -1 || node >= numa_nodes())
+		return 0;
+	return node;
+}
+
+// Set the policy of the whole pages of a mapped range, it is only a hint so failures are ignored
+void numa_policy(void *start, size_t length, int mode, unsigned long mask)
+{
+	size_t page_size = sysconf(_SC_PAGE_SIZE);
+	size_t begin = ((size_t)start + page_size - 1) & ~(page_size - 1);
+	size_t end = ((size_t)start + length + page_size - 1) & ~(page_size - 1);
+
+	if (begin < end)
+		syscall(SYS_mbind, begin, end - begin, mode, &mask, NUMA_MAX_NODES + 1, 0);
+}
+
+// Place a range of a heap on the node of the calling thread, before it is touched
+void numa_bind(void *start, size_t length)
+{
+	if (numa_nodes() > 1)
+		numa_policy(start, length, MPOL_PREFERRED, 1UL << numa_node());
+}
+
+// Place a new mapped block, before it is touched
+void numa_place(void *start, size_t length)
+{
+	size_t threshold = __atomic_load_n(&interleave_threshold, __ATOMIC_RELAXED);
+
+	if (numa_nodes() == 1)
+		return;
+	if (threshold && length >= threshold)
+		numa_policy(start, length, MPOL_INTERLEAVE, numa_allowed);
+	else
+		numa_bind(start, length);
+}
+
+// Pick the n-th arena out of count for the calling thread, round-robin over the arenas of its node
+size_t numa_arena(unsigned int n, size_t count)
+{
+	size_t nodes = numa_nodes();
+	size_t node = numa_node();
+
+	if (nodes == 1 || node >= count)
+		return n % count;
+	// The arenas of a node are the ones whose index is the node modulo the number of nodes, node 0 only takes the main one if it has no other
+	size_t first = node == 0 && count > nodes;
+	size_t per_node = (count - 1 - node) / nodes + 1 - first;
+	unsigned int k = __atomic_fetch_add(&numa_next[node], 1, __ATOMIC_RELAXED);
+
+	return node + (first + k % per_node) * nodes;
+}
@@ -1,155 +1,97 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#define _GNU_SOURCE
 #include "osmem.h"
 #include "helpers.h"
 
-struct block_meta *heap_start;
-struct block_meta *prefix;
-char first_brk = 1;
+/*
+ * Front end of the allocator, shared by every engine. Small objects go to the
+ * slabs and the caches when they are built in, blocks that reach the mmap
+ * threshold are mapped here, and the rest goes to the heap of an arena
+ * through heap_alloc, heap_free, heap_resize and heap_trim, which the engine
+ * selected in the Makefile implements.
+ */
 
-// Coalesce all blocks that are free after the given block
-void coalesce_next(struct block_meta *start, size_t max_size_to_expand)
-{
-	struct block_meta *header = start;
-	struct block_meta *next = header->next;
-
-	while (next != NULL) {
-		if (next->status == STATUS_FREE) {
-			header->size += next->size + BLOCK_META_SIZE;
-			header->next = next->next;
-			next = header->next;
-			if (header->size >= max_size_to_expand)
-				return;
-		} else
-			return;
-	}
-}
-
-// Coalesce all blocks that are free
-void coalesce_all_free(void)
-{
-	struct block_meta *header = prefix;
-
-	while (header != NULL) {
-		if (header->status == STATUS_FREE)
-			coalesce_next(header, LONG_MAX);
-		header = header->next;
-	}
-}
-
-// Find the first free block that fits the requested size
-struct block_meta *find_fit(struct block_meta **last, size_t size)
-{
-	coalesce_all_free();
-	struct block_meta *header = prefix;
-	struct block_meta *next = NULL;
-	size_t min_size = LONG_MAX;
-	struct block_meta *min_header = NULL;
-
-	// Find the first free block that fits the requested size
-	while (header != NULL) {
-		if (header->status == STATUS_FREE) {
-			next = header->next;
-			// Merge with the next block if it is free
-			if (next != NULL && next->status == STATUS_FREE) {
-				header->size += next->size + BLOCK_META_SIZE;
-				header->next = next->next;
-				continue;
-			}
-			// Found large enough block
-			if (header->size >= ALIGN(size)) {
-				// Update the minimum size and header
-				if (header->size < min_size) {
-					min_size = header->size;
-					min_header = header;
-				}
-			}
-		}
-		*last = header;
-		header = header->next;
-	}
-	return min_header;
-}
-
-// Split the block into two blocks, one with the requested size and one with the remaining size
-void split(struct block_meta *header, size_t size)
-{
-	size_t blk_size = ALIGN(size + BLOCK_META_SIZE);
-	struct block_meta *new_header = (struct block_meta *)((char *)header + blk_size);
-
-	new_header->size = header->size - size - BLOCK_META_SIZE;
-	new_header->status = STATUS_FREE;
-	new_header->next = header->next;
-	header->next = new_header;
-}
-
-// Allocate a new block
-void alloc(struct block_meta **header, struct block_meta *last, size_t size, size_t threshold)
+// Map a block that is not kept on the heap
+struct block_meta *map_block(size_t size)
 {
 	size_t blk_size = ALIGN(size + BLOCK_META_SIZE);
+	struct block_meta *header;
 
-	// Alloc with sbrk if the size is smaller than the threshold, otherwise use mmap
-	if (blk_size < threshold) {
-		// If it's the first time allocating with sbrk, allocate MMAP_THRESHOLD size
-		if (first_brk) {
-			(*header) = (struct block_meta *)sbrk(MMAP_THRESHOLD);
-			first_brk = 0;
-		} else
-			(*header) = (struct block_meta *)sbrk(blk_size);
-		DIE(*header == MAP_FAILED, "sbrk failed");
-		(*header)->status = STATUS_ALLOC;
-	} else {
-		(*header) = (struct block_meta *)mmap(NULL, blk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-		DIE(*header == MAP_FAILED, "mmap failed");
-		(*header)->status = STATUS_MAPPED;
+#ifdef MAPCACHE
+	header = mapcache_get(blk_size);
+	if (header)
+		return header;
+#endif
+#ifdef THP
+	if (blk_size >= HUGE_PAGE_SIZE) {
+		header = map_huge(blk_size);
+		INIT_HEADER(header, ALIGN(size), STATUS_MAPPED);
+		SET_ZEROED(header);
+		return header;
 	}
-	if (last)
-		last->next = *header;
-	(*header)->size = ALIGN(size);
-	(*header)->next = NULL;
+#endif
+	header = mmap(NULL, blk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+
+	DIE(header == MAP_FAILED, "mmap failed");
+#ifdef NUMA
+	numa_place(header, blk_size);
+#endif
+	INIT_HEADER(header, ALIGN(size), STATUS_MAPPED);
+	SET_ZEROED(header);
+	return header;
 }
 
 // Same as a malloc, but with a threshold parameter for using mmap
 // This is used because calloc uses a different threshold
-void *malloc_helper(size_t size, size_t threshold)
+// If dirty is not NULL, it gets how many bytes at the start of the payload may not be zero
+void *malloc_helper(size_t size, size_t threshold, size_t *dirty)
 {
-	// Alloc heap_start if it's the first time allocating
-	if (!heap_start) {
-		alloc(&heap_start, NULL, size, threshold);
-		if (prefix)
-			heap_start->next = prefix;
-		prefix = heap_start;
-		return (void *)((char *)heap_start + BLOCK_META_SIZE);
-	}
-
 	struct block_meta *header;
-	size_t alligned_size = ALIGN(size);
-	struct block_meta *last = heap_start;
-
-	// Find a free block that fits the requested size
-	header = find_fit(&last, size);
-	if (header) {
-		// Split the block if the remaining size is large enough to fit a block_meta struct and 1 byte
-		size_t diff = header->size - alligned_size;
-
-		if (diff >= ALIGN(1 + BLOCK_META_SIZE)) {
-			split(header, alligned_size);
-			header->size = alligned_size;
-		}
-		header->status = STATUS_ALLOC;
-	} else {
-		// If last block is free, extend it, otherwise allocate a new block
-		if (last->status == STATUS_FREE) {
-			size_t extra_size = alligned_size - last->size;
-
-			sbrk(extra_size);
-			header = last;
-			header->size = alligned_size;
-			header->status = STATUS_ALLOC;
-		} else {
-			alloc(&header, last, size, threshold);
-		}
+
+	if (dirty)
+		*dirty = size;
+#ifdef SLAB
+	// Small objects come from slabs, the heap only takes them once the slabs run out
+	if (size <= SLAB_MAX_SIZE) {
+		void *ptr = slab_alloc(size);
+
+		if (ptr)
+			return ptr;
+	}
+#endif
+
+	// Blocks over the threshold are always mapped, the heap is only searched for the rest
+	if (ALIGN(size + BLOCK_META_SIZE) >= threshold) {
+		header = map_block(size);
+		if (dirty && IS_ZEROED(header))
+			*dirty = 0;
+		return (void *)((char *)header + BLOCK_META_SIZE);
 	}
+
+#ifdef TCACHE
+	header = tcache_alloc(size);
+	if (header)
+		return (void *)((char *)header + BLOCK_META_SIZE);
+#endif
+#ifdef PCACHE
+	header = pcache_alloc(size);
+	if (header)
+		return (void *)((char *)header + BLOCK_META_SIZE);
+#endif
+
+	struct arena *arena = arena_get();
+
+	pthread_mutex_lock(&arena->lock);
+	char *fresh = arena->fresh;
+
+	header = heap_alloc(arena, size);
+	pthread_mutex_unlock(&arena->lock);
+	// Memory the heap grew by for this block was never used, a block mapped because the heap is full may be reused
+	if (dirty && GET_STATUS(header) == STATUS_MAPPED)
+		*dirty = IS_ZEROED(header) ? 0 : size;
+	else if (dirty)
+		*dirty = dirty_bytes(fresh, header, size);
 	return (void *)((char *)header + BLOCK_META_SIZE);
 }
 
@@ -157,57 +99,147 @@ void *os_malloc(size_t size)
 {
 	if (size == 0)
 		return NULL;
-	return malloc_helper(size, MMAP_THRESHOLD);
+	return malloc_helper(size, heap_threshold(), NULL);
 }
 
 void os_free(void *ptr)
 {
 	if (ptr == NULL)
 		return;
+#ifdef SLAB
+	if (slab_owns(ptr)) {
+		slab_free(ptr);
+		return;
+	}
+#endif
 	struct block_meta *header = (struct block_meta *)((char *)ptr - BLOCK_META_SIZE);
-	int prev_status = header->status;
-
-	header->status = STATUS_FREE;
-	coalesce_all_free();
-	if (prev_status == STATUS_MAPPED) {
-		if (header == heap_start)
-			prefix = heap_start->next;
-		int result = munmap(header, header->size + BLOCK_META_SIZE);
-
-		DIE(result == -1, "munmap failed");
-		if (header == heap_start)
-			heap_start = NULL;
+
+	if (GET_STATUS(header) == STATUS_ALIGNED)
+		header = aligned_block(header);
+	if (GET_STATUS(header) == STATUS_MAPPED) {
+		mmap_threshold_update(header);
+#ifdef MAPCACHE
+		if (mapcache_put(header))
+			return;
+#endif
+		unmap_block(header);
+		return;
+	}
+#ifdef PCACHE
+	// Any thread can cache a block on its CPU, the block keeps its arena
+	if (pcache_free(header, GET_SIZE(header)))
+		return;
+#endif
+	// Heap blocks go back to the arena that owns them, whichever thread frees them
+	arena_free(header, GET_SIZE(header));
+}
+
+void os_free_sized(void *ptr, size_t size)
+{
+	if (ptr == NULL)
+		return;
+#ifdef SLAB
+	if (slab_owns(ptr)) {
+		slab_free(ptr);
+		return;
 	}
+#endif
+#if (defined(PCACHE) || defined(TCACHE)) && !defined(ALIGNED_HEADERS)
+	// A heap block is known by its address and cached by the size it was asked with, its header is never read
+	if (size && heap_owns(ptr)) {
+		struct block_meta *header = (struct block_meta *)((char *)ptr - BLOCK_META_SIZE);
+
+#ifdef PCACHE
+		if (pcache_free(header, PAYLOAD_SIZE(size)))
+			return;
+#endif
+		arena_free(header, PAYLOAD_SIZE(size));
+		return;
+	}
+#else
+	(void)size;
+#endif
+	// Mapped blocks, and every block without a cache, need their header to be freed, and so
+	// does every block of an engine that puts a header in front of aligned payloads
+	os_free(ptr);
+}
+
+size_t os_malloc_usable_size(void *ptr)
+{
+	if (ptr == NULL)
+		return 0;
+#ifdef SLAB
+	if (slab_owns(ptr))
+		return slab_size(ptr);
+#endif
+	struct block_meta *header = (struct block_meta *)((char *)ptr - BLOCK_META_SIZE);
+
+	// An aligned payload inside a bigger block has what is left of that block past it
+	if (GET_STATUS(header) == STATUS_ALIGNED)
+		return GET_SIZE(aligned_block(header)) - GET_SIZE(header);
+	// Blocks are never smaller than asked, ALIGN and blocks that are too small to split leave room after the payload
+	return GET_SIZE(header);
 }
 
 void *os_calloc(size_t nmemb, size_t size)
 {
+	size_t total_size;
+
 	if (nmemb == 0 || size == 0)
 		return NULL;
-	size_t total_size = nmemb * size;
+	// Like calloc, a total size that doesn't fit in size_t fails instead of wrapping around
+	if (__builtin_mul_overflow(nmemb, size, &total_size)) {
+		errno = ENOMEM;
+		return NULL;
+	}
 
 	long sz = sysconf(_SC_PAGE_SIZE);
 
 	DIE(sz == -1, "sysconf failed");
-	void *ptr = malloc_helper(total_size, sz);
+#ifdef DYNAMIC_THRESHOLD
+	// Zeroed blocks follow the threshold of os_malloc too, so they get reused instead of mapped every time
+	sz = heap_threshold();
+#endif
+	size_t dirty;
+	void *ptr = malloc_helper(total_size, sz, &dirty);
 
 	DIE(ptr == NULL, "os_malloc failed");
 
-	memset(ptr, 0, total_size);
+	// Fresh pages from the kernel are zero already, so only memory that was used before is cleared
+	memset(ptr, 0, dirty);
 	return ptr;
 }
 
-// Check if the block needs to be changed from sbrk to mmap or vice versa
-char changes_alloc_type(struct block_meta *header, size_t size)
+// Give the free memory of every heap back to the kernel, keeping pad bytes at the top of each
+int os_malloc_trim(size_t pad)
+{
+	char released = 0;
+
+	for (size_t i = 0; i < ARENA_MAX; i++) {
+		struct arena *arena = &arenas[i];
+
+		pthread_mutex_lock(&arena->lock);
+		if (arena->heap_start) {
+			arena_drain(arena);
+			released |= heap_trim(arena, pad);
+		}
+		pthread_mutex_unlock(&arena->lock);
+	}
+	return released;
+}
+
+#ifdef MREMAP
+// Resize a mapped block by remapping its pages, it only moves if it can't grow in place
+struct block_meta *remap_block(struct block_meta *header, size_t size)
 {
 	size_t blk_size = ALIGN(size + BLOCK_META_SIZE);
 
-	if (header->status == STATUS_MAPPED && blk_size < MMAP_THRESHOLD)
-		return 1;
-	if (header->status == STATUS_ALLOC && blk_size >= MMAP_THRESHOLD)
-		return 1;
-	return 0;
+	header = mremap(header, GET_SIZE(header) + BLOCK_META_SIZE, blk_size, MREMAP_MAYMOVE);
+	DIE(header == MAP_FAILED, "mremap failed");
+	SET_SIZE(header, ALIGN(size));
+	return header;
 }
+#endif
 
 void *os_realloc(void *ptr, size_t size)
 {
@@ -217,53 +249,58 @@ void *os_realloc(void *ptr, size_t size)
 		os_free(ptr);
 		return NULL;
 	}
+#ifdef SLAB
+	// Small objects stay in place while the new size fits their class
+	if (slab_owns(ptr)) {
+		size_t old_size = slab_size(ptr);
+
+		if (size <= old_size)
+			return ptr;
+		void *new_ptr = os_malloc(size);
+
+		DIE(new_ptr == NULL, "os_malloc failed");
+		memcpy(new_ptr, ptr, old_size);
+		slab_free(ptr);
+		return new_ptr;
+	}
+#endif
 	struct block_meta *header = (struct block_meta *)((char *)ptr - BLOCK_META_SIZE);
 
-	if (header->status == STATUS_FREE)
+	if (GET_STATUS(header) == STATUS_FREE)
 		return NULL;
-	size_t old_size = header->size;
-	size_t blk_size = ALIGN(size + BLOCK_META_SIZE);
-	size_t alligned_size = ALIGN(size);
-
-	// If the new size is smaller than the old size, we might be able to split the block
-	if (old_size >= alligned_size) {
-		// Check if the block doesn't need to change allocation type
-		if (changes_alloc_type(header, size) == 0) {
-			if (old_size - alligned_size >= ALIGN(1 + BLOCK_META_SIZE)) {
-				split(header, alligned_size);
-				header->size = alligned_size;
-			}
-			return ptr;
-		}
-		if (old_size == alligned_size)
-			return ptr;
-	} else {
-		// Check if block is last block to do expanding
-		if (header->next == NULL && header->status == STATUS_ALLOC && blk_size < MMAP_THRESHOLD) {
-			size_t extra_size = alligned_size - old_size;
+	size_t old_size = GET_SIZE(header);
+
+	// An aligned payload is always moved, it holds what is left of its block past it
+	if (GET_STATUS(header) == STATUS_ALIGNED)
+		old_size = GET_SIZE(aligned_block(header)) - GET_SIZE(header);
 
-			sbrk(extra_size);
-			header->size = alligned_size;
+	// Heap blocks are resized in place under the lock of the arena that owns them
+	if (GET_STATUS(header) == STATUS_ALLOC) {
+		struct arena *arena = arena_of(header);
+
+		pthread_mutex_lock(&arena->lock);
+		char resized = heap_resize(arena, header, size);
+
+		pthread_mutex_unlock(&arena->lock);
+		if (resized)
 			return ptr;
-		}
-		// Try to coalesce the block with the next ones
-		coalesce_next(header, alligned_size);
-		if (header->size >= alligned_size) {
-			// Check if the block doesn't need to change allocation type
-			if (changes_alloc_type(header, size) == 0) {
-				if (header->size - alligned_size >= ALIGN(1 + BLOCK_META_SIZE)) {
-					split(header, alligned_size);
-					header->size = alligned_size;
-				}
-				return ptr;
-			}
-		}
+	} else if (GET_STATUS(header) == STATUS_MAPPED && old_size == ALIGN(size)) {
+		return ptr;
 	}
+#ifdef MREMAP
+	// Mapped blocks stay mapped without copying anything, unless they become smaller than a page
+	// Aligned ones don't start their mapping, which mremap needs
+	size_t page_size = sysconf(_SC_PAGE_SIZE);
+
+	if (GET_STATUS(header) == STATUS_MAPPED && ALIGN(size + BLOCK_META_SIZE) >= page_size &&
+	    ((size_t)header & (page_size - 1)) == 0)
+		return (char *)remap_block(header, size) + BLOCK_META_SIZE;
+#endif
 	// If the block was not coalesced or expanded, allocate a new block and copy the data
 	void *new_ptr = os_malloc(size);
 
 	DIE(new_ptr == NULL, "os_malloc failed");
-	size_t lowest = old_size < alligned_size ? old_size : alligned_size;
+	size_t lowest = old_size < ALIGN(size) ? old_size : ALIGN(size);
 
 	memcpy(new_ptr, ptr, lowest);
 	os_free(ptr);
@@ -13,7 +13,36 @@
 #define BLOCK_META_SIZE ALIGN(sizeof(struct block_meta))
 #define MMAP_THRESHOLD (128 * 1024)
 
+/* Parameters of os_mallopt */
+#define OS_M_MMAP_THRESHOLD	1
+#define OS_M_MMAP_THRESHOLD_MAX	2
+#define OS_M_INTERLEAVE_THRESHOLD	3
+#define OS_M_TOP_PAD	4
+#define OS_M_TRIM_THRESHOLD	5
+
+struct os_malloc_stats {
+	size_t mmap_threshold;
+	size_t mmap_threshold_max;
+	int dynamic_threshold;
+	size_t heap_bytes;
+	unsigned int numa_nodes;
+	size_t interleave_threshold;
+	size_t top_pad;
+	size_t trim_threshold;
+};
+
 void *os_malloc(size_t size);
 void os_free(void *ptr);
+void os_free_sized(void *ptr, size_t size);
+size_t os_malloc_usable_size(void *ptr);
 void *os_calloc(size_t nmemb, size_t size);
 void *os_realloc(void *ptr, size_t size);
+int os_malloc_trim(size_t pad);
+void *os_memalign(size_t alignment, size_t size);
+void *os_aligned_alloc(size_t alignment, size_t size);
+int os_posix_memalign(void **memptr, size_t alignment, size_t size);
+size_t os_malloc_batch(size_t size, size_t n, void **out);
+/* Uses ptrs as scratch space to sort the blocks, so its contents are undefined once it returns */
+void os_free_batch(void **ptrs, size_t n);
+int os_mallopt(int param, size_t value);
+void os_malloc_stats(struct os_malloc_stats *stats);
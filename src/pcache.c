@@ -0,0 +1,273 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+#include <sched.h>
+
+#include "osmem.h"
+#include "helpers.h"
+
+/*
+ * Per-CPU cache. Every CPU keeps up to PCACHE_COUNT freed blocks of each
+ * small size, still marked as allocated, in a stack of slots shared by all
+ * threads that run on it. Idle threads hold nothing, so the memory held by the
+ * cache depends on the number of CPUs and not on the number of threads.
+ *
+ * Push and pop are restartable sequences: the kernel moves a thread that is
+ * preempted or migrated inside one back to its start, so a stack is only ever
+ * changed by the CPU it belongs to and a single store commits the change
+ * without any atomics. Without rseq, the CPU comes from sched_getcpu and its
+ * stacks are changed under a spinlock.
+ */
+#define PCACHE_MAX	256
+#define PCACHE_BINS	(PCACHE_MAX / ALIGNMENT)
+#define PCACHE_COUNT	16
+#define PCACHE_BATCH	8
+#define PCACHE_CPUS	256
+
+#if defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define PCACHE_RSEQ
+#endif
+#endif
+
+struct pcache {
+	size_t used[PCACHE_BINS];
+	struct block_meta *slots[PCACHE_BINS][PCACHE_COUNT];
+	char lock;
+};
+
+struct pcache pcaches[PCACHE_CPUS];
+
+#ifdef PCACHE_RSEQ
+// Get the rseq area glibc registered for the calling thread, NULL if the CPU can't be read from it
+struct rseq *pcache_rseq(void)
+{
+	if (__rseq_size == 0)
+		return NULL;
+	struct rseq *rs = (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+
+	if (__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED) >= PCACHE_CPUS)
+		return NULL;
+	return rs;
+}
+
+#define __stringify_1(x) #x
+#define __stringify(x) __stringify_1(x)
+
+/*
+ * Both sequences start by storing their descriptor in rseq_cs, and their
+ * abort handler, behind the signature the kernel checks, starts them again.
+ * The store to used[] is the last instruction of a sequence and commits it.
+ */
+#define RSEQ_SEQUENCE(body)						\
+	".pushsection __rseq_cs, \"aw\"\n\t"				\
+	".balign 32\n\t"						\
+	"3: .long 0, 0\n\t"						\
+	".quad 1f, 2f - 1f, 4f\n\t"					\
+	".popsection\n\t"						\
+	"0: leaq 3b(%%rip), %%rax\n\t"					\
+	"movq %%rax, %c[cs](%[rs])\n\t"					\
+	"1: movl %c[cpu](%[rs]), %%eax\n\t"				\
+	"cmpl %[cpus], %%eax\n\t"					\
+	"jae 5f\n\t"							\
+	"imulq %[size], %%rax, %%rax\n\t"				\
+	"addq %[base], %%rax\n\t"					\
+	"movq (%%rax, %[bin], 8), %%rdx\n\t"				\
+	body								\
+	".pushsection __rseq_failure, \"ax\"\n\t"			\
+	".long " __stringify(RSEQ_SIG) "\n\t"				\
+	"4: jmp 0b\n\t"							\
+	".popsection\n\t"
+
+#define RSEQ_OPERANDS(rs, bin)						\
+	[rs] "r" (rs), [bin] "r" (bin), [base] "r" (pcaches),		\
+	[slots] "r" (offsetof(struct pcache, slots) + (bin) * PCACHE_COUNT * sizeof(void *)), \
+	[cs] "i" (offsetof(struct rseq, rseq_cs)), [cpu] "i" (offsetof(struct rseq, cpu_id)), \
+	[cpus] "i" (PCACHE_CPUS), [size] "i" (sizeof(struct pcache)), [count] "i" (PCACHE_COUNT)
+
+// Pop a block from a bin of the current CPU, NULL if the bin is empty
+struct block_meta *rseq_pop(struct rseq *rs, size_t bin)
+{
+	struct block_meta *header;
+
+	asm volatile(RSEQ_SEQUENCE(
+		     "testq %%rdx, %%rdx\n\t"
+		     "jz 5f\n\t"
+		     "decq %%rdx\n\t"
+		     "leaq (%%rax, %[slots]), %%rcx\n\t"
+		     "movq (%%rcx, %%rdx, 8), %[header]\n\t"
+		     "movq %%rdx, (%%rax, %[bin], 8)\n\t"
+		     "2: jmp 6f\n\t"
+		     "5: xorl %k[header], %k[header]\n\t"
+		     "6:\n\t")
+		     : [header] "=&r" (header)
+		     : RSEQ_OPERANDS(rs, bin)
+		     : "rax", "rcx", "rdx", "memory", "cc");
+	return header;
+}
+
+// Push a block on a bin of the current CPU, 0 if the bin is full
+char rseq_push(struct rseq *rs, size_t bin, struct block_meta *header)
+{
+	char pushed;
+
+	asm volatile(RSEQ_SEQUENCE(
+		     "cmpq %[count], %%rdx\n\t"
+		     "jae 5f\n\t"
+		     "leaq (%%rax, %[slots]), %%rcx\n\t"
+		     "movq %[header], (%%rcx, %%rdx, 8)\n\t"
+		     "incq %%rdx\n\t"
+		     "movq %%rdx, (%%rax, %[bin], 8)\n\t"
+		     "2: movb $1, %[pushed]\n\t"
+		     "jmp 6f\n\t"
+		     "5: movb $0, %[pushed]\n\t"
+		     "6:\n\t")
+		     : [pushed] "=&r" (pushed)
+		     : RSEQ_OPERANDS(rs, bin), [header] "r" (header)
+		     : "rax", "rcx", "rdx", "memory", "cc");
+	return pushed;
+}
+#endif
+
+// Lock the cache of the CPU the thread runs on, NULL if that CPU has no cache
+struct pcache *pcache_lock(void)
+{
+	int cpu = sched_getcpu();
+
+	if (cpu < 0 || cpu >= PCACHE_CPUS)
+		return NULL;
+	struct pcache *pcache = &pcaches[cpu];
+
+	while (__atomic_test_and_set(&pcache->lock, __ATOMIC_ACQUIRE))
+		;
+	return pcache;
+}
+
+void pcache_unlock(struct pcache *pcache)
+{
+	__atomic_clear(&pcache->lock, __ATOMIC_RELEASE);
+}
+
+// Pop a block from a bin of the current CPU, NULL if the bin is empty
+struct block_meta *pcache_pop(size_t bin)
+{
+#ifdef PCACHE_RSEQ
+	struct rseq *rs = pcache_rseq();
+
+	if (rs)
+		return rseq_pop(rs, bin);
+#endif
+	struct pcache *pcache = pcache_lock();
+	struct block_meta *header = NULL;
+
+	if (pcache == NULL)
+		return NULL;
+	if (pcache->used[bin])
+		header = pcache->slots[bin][--pcache->used[bin]];
+	pcache_unlock(pcache);
+	return header;
+}
+
+// Push a block on a bin of the current CPU, 0 if the bin is full
+char pcache_push(size_t bin, struct block_meta *header)
+{
+#ifdef PCACHE_RSEQ
+	struct rseq *rs = pcache_rseq();
+
+	if (rs)
+		return rseq_push(rs, bin, header);
+#endif
+	struct pcache *pcache = pcache_lock();
+	char pushed = 0;
+
+	if (pcache == NULL)
+		return 0;
+	if (pcache->used[bin] < PCACHE_COUNT) {
+		pcache->slots[bin][pcache->used[bin]++] = header;
+		pushed = 1;
+	}
+	pcache_unlock(pcache);
+	return pushed;
+}
+
+// Give blocks back to the arenas that own them, locking each arena once for a run of its blocks
+void pcache_release(struct block_meta **blocks, unsigned int count)
+{
+	struct arena *locked = NULL;
+
+	for (unsigned int i = 0; i < count; i++) {
+		struct block_meta *header = blocks[i];
+
+		// Blocks that were mapped because a secondary heap was full go straight back
+		if (GET_STATUS(header) == STATUS_MAPPED) {
+			DIE(munmap(header, GET_SIZE(header) + BLOCK_META_SIZE) == -1, "munmap failed");
+			continue;
+		}
+		struct arena *arena = arena_of(header);
+
+		if (arena != locked) {
+			if (locked)
+				pthread_mutex_unlock(&locked->lock);
+			pthread_mutex_lock(&arena->lock);
+			locked = arena;
+		}
+		heap_free(arena, header);
+	}
+	if (locked)
+		pthread_mutex_unlock(&locked->lock);
+}
+
+// Allocate a small heap block from the cache of the current CPU, NULL if the size is not cached
+struct block_meta *pcache_alloc(size_t size)
+{
+	size_t alligned_size = PAYLOAD_SIZE(size);
+
+	if (alligned_size > PCACHE_MAX)
+		return NULL;
+	size_t bin = alligned_size / ALIGNMENT - 1;
+	struct block_meta *header = pcache_pop(bin);
+
+	if (header)
+		return header;
+
+	// Refill the bin with a batch of blocks taken under a single lock
+	struct block_meta *blocks[PCACHE_BATCH];
+	struct arena *arena = arena_get();
+	unsigned int left = 0;
+
+	pthread_mutex_lock(&arena->lock);
+	for (int i = 0; i < PCACHE_BATCH; i++)
+		blocks[i] = heap_alloc(arena, size);
+	pthread_mutex_unlock(&arena->lock);
+
+	// Blocks that don't fit anymore, because other threads filled the bin meanwhile, go back
+	header = blocks[0];
+	for (int i = 1; i < PCACHE_BATCH; i++)
+		if (pcache_push(bin, blocks[i]) == 0)
+			blocks[left++] = blocks[i];
+	if (left)
+		pcache_release(blocks, left);
+	return header;
+}
+
+// Cache a freed heap block in the bin of the given size, 0 if it is not cached and has to be freed
+char pcache_free(struct block_meta *header, size_t size)
+{
+	if (size > PCACHE_MAX)
+		return 0;
+	size_t bin = size / ALIGNMENT - 1;
+
+	if (pcache_push(bin, header))
+		return 1;
+
+	// The bin is full, so half of it goes back to the arenas along with the block
+	struct block_meta *blocks[PCACHE_COUNT / 2 + 1];
+	unsigned int count = 0;
+
+	blocks[count++] = header;
+	while (count <= PCACHE_COUNT / 2 && (blocks[count] = pcache_pop(bin)))
+		count++;
+	pcache_release(blocks, count);
+	return 1;
+}
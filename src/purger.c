@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <signal.h>
+
+#include "osmem.h"
+#include "helpers.h"
+
+/*
+ * Background purger. A detached thread is started the first time a free block
+ * becomes dirty, and wakes up PURGER_STEPS times per decay time to purge the
+ * blocks of every arena that have decayed, so memory goes back even while the
+ * program doesn't call the allocator. Arenas that are locked are skipped, their
+ * threads purge them on their next call into the heap anyway.
+ */
+#define PURGER_STEPS	10
+#define PURGER_STEP_MS	(DECAY_MS / PURGER_STEPS ? DECAY_MS / PURGER_STEPS : 1)
+
+pthread_once_t purger_once = PTHREAD_ONCE_INIT;
+
+// Purge the decayed blocks of every arena, forever
+void *purger_main(void *arg)
+{
+	struct timespec step = {
+		.tv_sec = PURGER_STEP_MS / 1000,
+		.tv_nsec = PURGER_STEP_MS % 1000 * 1000000,
+	};
+
+	(void)arg;
+	while (1) {
+		nanosleep(&step, NULL);
+		for (size_t i = 0; i < ARENA_MAX; i++) {
+			struct arena *arena = &arenas[i];
+
+			if (__atomic_load_n(&arena->dirty_head, __ATOMIC_RELAXED) == NULL)
+				continue;
+			if (pthread_mutex_trylock(&arena->lock) != 0)
+				continue;
+			decay_purge(arena, 0);
+			pthread_mutex_unlock(&arena->lock);
+		}
+	}
+	return NULL;
+}
+
+// Start the purger with every signal blocked, so it never handles the signals of the program
+void purger_create(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+
+	sigfillset(&all);
+	DIE(pthread_sigmask(SIG_SETMASK, &all, &old) != 0, "pthread_sigmask failed");
+	DIE(pthread_attr_init(&attr) != 0, "pthread_attr_init failed");
+	DIE(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0, "pthread_attr_setdetachstate failed");
+	DIE(pthread_create(&thread, &attr, purger_main, NULL) != 0, "pthread_create failed");
+	pthread_attr_destroy(&attr);
+	DIE(pthread_sigmask(SIG_SETMASK, &old, NULL) != 0, "pthread_sigmask failed");
+}
+
+// Start the purger unless it is already running
+void purger_start(void)
+{
+	pthread_once(&purger_once, purger_create);
+}
@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "osmem.h"
+#include "helpers.h"
+
+/*
+ * Small objects live in slabs: SLAB_PAGE_SIZE pages that hold objects of a
+ * single size class and nothing else. The page starts with a struct slab and
+ * the objects follow it without any header of their own. All slabs are carved
+ * out of one region that is reserved on the first small allocation, so a
+ * pointer belongs to a slab exactly when it falls inside that region. Slabs
+ * are shared by all threads and taken under a single lock.
+ */
+#define SLAB_PAGE_SIZE		(16UL * 1024)
+#define SLAB_REGION_SIZE	(256UL * 1024 * 1024)
+#define SLAB_CLASSES		(sizeof(slab_class_size) / sizeof(slab_class_size[0]))
+
+struct slab {
+	struct slab *next;
+	struct slab *prev;
+	void *free;
+	char *bump;
+	unsigned int used;
+	unsigned int size_class;
+};
+
+const unsigned short slab_class_size[] = {
+	8, 16, 24, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256, 320, 384, 448, 512,
+	640, 768, 896, 1024
+};
+
+unsigned char slab_class_of[SLAB_MAX_SIZE / ALIGNMENT + 1];
+struct slab *partial_slabs[SLAB_CLASSES];
+struct slab *empty_pages;
+pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+char *slab_region;
+char *slab_region_top;
+
+// Reserve the slab region and fill the table that maps sizes to classes
+char slab_init(void)
+{
+	size_t cls = 0;
+	char *region = mmap(NULL, SLAB_REGION_SIZE + SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+
+	if (region == MAP_FAILED)
+		return 0;
+	for (size_t i = 0; i <= SLAB_MAX_SIZE / ALIGNMENT; i++) {
+		if (i * ALIGNMENT > slab_class_size[cls])
+			cls++;
+		slab_class_of[i] = cls;
+	}
+	// Slab pages are aligned to their size, so the page of an object is found by masking
+	slab_region = (char *)(((size_t)region + SLAB_PAGE_SIZE - 1) & ~(SLAB_PAGE_SIZE - 1));
+	slab_region_top = slab_region;
+	return 1;
+}
+
+// Check if the pointer was handed out by the slab layer
+char slab_owns(void *ptr)
+{
+	return slab_region && (size_t)((char *)ptr - slab_region) < SLAB_REGION_SIZE;
+}
+
+// Get the slab page that holds the given object
+struct slab *slab_of(void *ptr)
+{
+	return (struct slab *)((size_t)ptr & ~(SLAB_PAGE_SIZE - 1));
+}
+
+// Check if a slab has no object left to hand out
+char slab_full(struct slab *slab)
+{
+	return slab->free == NULL &&
+	       slab->bump + slab_class_size[slab->size_class] > (char *)slab + SLAB_PAGE_SIZE;
+}
+
+// Add a slab to the front of the partial list of its class
+void slab_link(struct slab *slab)
+{
+	struct slab **head = &partial_slabs[slab->size_class];
+
+	slab->prev = NULL;
+	slab->next = *head;
+	if (*head)
+		(*head)->prev = slab;
+	*head = slab;
+}
+
+// Remove a slab from the partial list of its class
+void slab_unlink(struct slab *slab)
+{
+	if (slab->next)
+		slab->next->prev = slab->prev;
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		partial_slabs[slab->size_class] = slab->next;
+}
+
+// Get an empty page for the given class, reusing released pages first
+struct slab *slab_new(size_t cls)
+{
+	struct slab *slab = empty_pages;
+
+	if (slab) {
+		empty_pages = slab->next;
+	} else {
+		if (slab_region_top == slab_region + SLAB_REGION_SIZE)
+			return NULL;
+		slab = (struct slab *)slab_region_top;
+		slab_region_top += SLAB_PAGE_SIZE;
+	}
+	slab->free = NULL;
+	slab->bump = (char *)slab + ALIGN(sizeof(struct slab));
+	slab->used = 0;
+	slab->size_class = cls;
+	slab_link(slab);
+	return slab;
+}
+
+// Allocate a small object, NULL if the slab region is used up
+void *slab_alloc(size_t size)
+{
+	pthread_mutex_lock(&slab_lock);
+	if (slab_region == NULL && slab_init() == 0) {
+		pthread_mutex_unlock(&slab_lock);
+		return NULL;
+	}
+	size_t cls = slab_class_of[ALIGN(size) / ALIGNMENT];
+	struct slab *slab = partial_slabs[cls];
+	void *ptr;
+
+	if (slab == NULL) {
+		slab = slab_new(cls);
+		if (slab == NULL) {
+			pthread_mutex_unlock(&slab_lock);
+			return NULL;
+		}
+	}
+	if (slab->free) {
+		ptr = slab->free;
+		slab->free = *(void **)ptr;
+	} else {
+		ptr = slab->bump;
+		slab->bump += slab_class_size[cls];
+	}
+	slab->used++;
+	if (slab_full(slab))
+		slab_unlink(slab);
+	pthread_mutex_unlock(&slab_lock);
+	return ptr;
+}
+
+// Give a small object back to its slab
+void slab_free(void *ptr)
+{
+	struct slab *slab = slab_of(ptr);
+
+	pthread_mutex_lock(&slab_lock);
+	char full = slab_full(slab);
+
+	*(void **)ptr = slab->free;
+	slab->free = ptr;
+	slab->used--;
+	if (full)
+		slab_link(slab);
+
+	// Empty pages are released, except the last one of the class so it doesn't thrash
+	if (slab->used == 0 && (slab->prev || slab->next)) {
+		slab_unlink(slab);
+		madvise(slab, SLAB_PAGE_SIZE, MADV_DONTNEED);
+		slab->next = empty_pages;
+		empty_pages = slab;
+	}
+	pthread_mutex_unlock(&slab_lock);
+}
+
+// Get the size that can be used in a small object
+size_t slab_size(void *ptr)
+{
+	return slab_class_size[slab_of(ptr)->size_class];
+}
@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "osmem.h"
+#include "helpers.h"
+
+/*
+ * Thread cache. Every thread keeps up to TCACHE_COUNT freed blocks of each
+ * small size in thread-local bins, still marked as allocated, and hands them
+ * out again without taking any lock. An empty bin is refilled with
+ * TCACHE_BATCH blocks under a single lock of the arena, and a full bin gives
+ * half of its blocks back to their arenas at once. The blocks left in the
+ * cache go back when the thread exits. Cached blocks are linked through the
+ * first word of their payload, so os_free_sized caches a block without
+ * writing its header.
+ */
+#define TCACHE_MAX	256
+#define TCACHE_BINS	(TCACHE_MAX / ALIGNMENT)
+#define TCACHE_COUNT	16
+#define TCACHE_BATCH	8
+#define TCACHE_NEXT(header) (*(struct block_meta **)((char *)(header) + BLOCK_META_SIZE))
+
+/* Cache states, a thread that is exiting doesn't cache anything anymore */
+#define TCACHE_NEW	0
+#define TCACHE_ON	1
+#define TCACHE_OFF	2
+
+struct tcache {
+	struct block_meta *bins[TCACHE_BINS];
+	unsigned char counts[TCACHE_BINS];
+	char state;
+};
+
+__thread struct tcache tcache;
+pthread_key_t tcache_key;
+pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+// Give up to count blocks of a bin back to the arenas that own them
+void tcache_flush(size_t idx, unsigned int count)
+{
+	struct arena *locked = NULL;
+
+	while (count-- && tcache.bins[idx]) {
+		struct block_meta *header = tcache.bins[idx];
+
+		tcache.bins[idx] = TCACHE_NEXT(header);
+		tcache.counts[idx]--;
+
+		// Blocks that were mapped because a secondary heap was full go straight back
+		if (GET_STATUS(header) == STATUS_MAPPED) {
+			DIE(munmap(header, GET_SIZE(header) + BLOCK_META_SIZE) == -1, "munmap failed");
+			continue;
+		}
+		// Consecutive blocks of the same arena are freed under one lock
+		struct arena *arena = arena_of(header);
+
+		if (arena != locked) {
+			if (locked)
+				pthread_mutex_unlock(&locked->lock);
+			pthread_mutex_lock(&arena->lock);
+			locked = arena;
+		}
+		heap_free(arena, header);
+	}
+	if (locked)
+		pthread_mutex_unlock(&locked->lock);
+}
+
+// Give the cached blocks of an exiting thread back
+void tcache_release(void *arg)
+{
+	(void)arg;
+	for (size_t idx = 0; idx < TCACHE_BINS; idx++)
+		tcache_flush(idx, TCACHE_COUNT);
+	tcache.state = TCACHE_OFF;
+}
+
+void tcache_key_create(void)
+{
+	DIE(pthread_key_create(&tcache_key, tcache_release) != 0, "pthread_key_create failed");
+}
+
+// Register the cache of the calling thread so it is released when the thread exits
+void tcache_init(void)
+{
+	pthread_once(&tcache_once, tcache_key_create);
+	DIE(pthread_setspecific(tcache_key, &tcache) != 0, "pthread_setspecific failed");
+	tcache.state = TCACHE_ON;
+}
+
+// Push a block on the bin of the given index
+void tcache_push(size_t idx, struct block_meta *header)
+{
+	TCACHE_NEXT(header) = tcache.bins[idx];
+	tcache.bins[idx] = header;
+	tcache.counts[idx]++;
+}
+
+// Allocate a small heap block from the cache, NULL if the size is not cached
+struct block_meta *tcache_alloc(size_t size)
+{
+	size_t alligned_size = PAYLOAD_SIZE(size);
+
+	if (alligned_size > TCACHE_MAX || tcache.state == TCACHE_OFF)
+		return NULL;
+	if (tcache.state == TCACHE_NEW)
+		tcache_init();
+	size_t idx = alligned_size / ALIGNMENT - 1;
+	struct block_meta *header = tcache.bins[idx];
+
+	if (header) {
+		tcache.bins[idx] = TCACHE_NEXT(header);
+		tcache.counts[idx]--;
+		return header;
+	}
+
+	// Refill the bin with a batch of blocks under a single lock
+	struct arena *arena = arena_get();
+
+	pthread_mutex_lock(&arena->lock);
+	header = heap_alloc(arena, size);
+	for (int i = 1; i < TCACHE_BATCH; i++)
+		tcache_push(idx, heap_alloc(arena, size));
+	pthread_mutex_unlock(&arena->lock);
+	return header;
+}
+
+// Cache a freed heap block in the bin of the given size, 0 if it is not cached and has to be freed
+char tcache_free(struct block_meta *header, size_t size)
+{
+	if (size > TCACHE_MAX || tcache.state == TCACHE_OFF)
+		return 0;
+	if (tcache.state == TCACHE_NEW)
+		tcache_init();
+	size_t idx = size / ALIGNMENT - 1;
+
+	if (tcache.counts[idx] == TCACHE_COUNT)
+		tcache_flush(idx, TCACHE_COUNT / 2);
+	tcache_push(idx, header);
+	return 1;
+}
@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "osmem.h"
+#include "helpers.h"
+
+/*
+ * Two-level segregated fit. The first level splits sizes by powers of two and
+ * the second level splits every power of two into SL_COUNT linear classes.
+ * Sizes under SMALL_BLOCK_SIZE all share the first level, one class for every
+ * ALIGNMENT step. A bitmap for each level finds a non-empty list with a single
+ * ctz, so inserting, removing and finding a block all take constant time.
+ */
+#define SL_LOG2			4
+#define SL_COUNT		(1UL << SL_LOG2)
+#define ALIGNMENT_LOG2		3
+#define FL_SHIFT		(SL_LOG2 + ALIGNMENT_LOG2)
+#define SMALL_BLOCK_SIZE	(1UL << FL_SHIFT)
+#define FL_COUNT		(SIZE_BITS - FL_SHIFT + 1)
+
+/* Every arena has its own lists and bitmaps */
+struct free_index {
+	size_t fl_bitmap;
+	size_t sl_bitmap[FL_COUNT];
+	struct block_meta *blocks[FL_COUNT][SL_COUNT];
+};
+
+struct free_index indexes[ARENA_MAX];
+
+// Get the first and second level class of a block with the given size
+void mapping_insert(size_t size, size_t *fl, size_t *sl)
+{
+	if (size < SMALL_BLOCK_SIZE) {
+		*fl = 0;
+		*sl = size / (SMALL_BLOCK_SIZE / SL_COUNT);
+		return;
+	}
+	size_t log2 = SIZE_BITS - 1 - __builtin_clzl(size);
+
+	*fl = log2 - FL_SHIFT + 1;
+	*sl = (size >> (log2 - SL_LOG2)) ^ SL_COUNT;
+}
+
+// Get the first class whose blocks are all large enough for the given size
+void mapping_search(size_t size, size_t *fl, size_t *sl)
+{
+	if (size >= SMALL_BLOCK_SIZE)
+		size += (1UL << (SIZE_BITS - 1 - __builtin_clzl(size) - SL_LOG2)) - 1;
+	mapping_insert(size, fl, sl);
+}
+
+// Add a free block to the front of its list
+void bin_insert(struct arena *arena, struct block_meta *header)
+{
+	struct free_index *index = &indexes[ARENA_ID(arena)];
+	size_t fl, sl;
+
+	mapping_insert(GET_SIZE(header), &fl, &sl);
+	FREE_NEXT(header) = index->blocks[fl][sl];
+	FREE_PREV(header) = NULL;
+	if (FREE_NEXT(header))
+		FREE_PREV(FREE_NEXT(header)) = header;
+	index->blocks[fl][sl] = header;
+	index->fl_bitmap |= 1UL << fl;
+	index->sl_bitmap[fl] |= 1UL << sl;
+}
+
+// Remove a free block from its list
+void bin_remove(struct arena *arena, struct block_meta *header)
+{
+	struct free_index *index = &indexes[ARENA_ID(arena)];
+	size_t fl, sl;
+	struct block_meta *prev = FREE_PREV(header);
+
+	if (FREE_NEXT(header))
+		FREE_PREV(FREE_NEXT(header)) = prev;
+	if (prev) {
+		FREE_NEXT(prev) = FREE_NEXT(header);
+		return;
+	}
+	mapping_insert(GET_SIZE(header), &fl, &sl);
+	index->blocks[fl][sl] = FREE_NEXT(header);
+	if (index->blocks[fl][sl] == NULL) {
+		index->sl_bitmap[fl] &= ~(1UL << sl);
+		if (index->sl_bitmap[fl] == 0)
+			index->fl_bitmap &= ~(1UL << fl);
+	}
+}
+
+// Find a free block that fits the requested size, taking the first one from the
+// smallest class that is guaranteed to fit instead of searching for the best fit
+struct block_meta *find_fit(struct arena *arena, size_t size)
+{
+	struct free_index *index = &indexes[ARENA_ID(arena)];
+	size_t fl, sl;
+
+	mapping_search(size, &fl, &sl);
+	if (fl >= FL_COUNT)
+		return NULL;
+
+	size_t sl_map = index->sl_bitmap[fl] & (~0UL << sl);
+
+	if (sl_map == 0) {
+		size_t fl_map = fl + 1 < FL_COUNT ? index->fl_bitmap & (~0UL << (fl + 1)) : 0;
+
+		if (fl_map == 0)
+			return NULL;
+		fl = __builtin_ctzl(fl_map);
+		sl_map = index->sl_bitmap[fl];
+	}
+	sl = __builtin_ctzl(sl_map);
+	return index->blocks[fl][sl];
+}
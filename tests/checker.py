@@ -1,13 +1,18 @@
 # SPDX-License-Identifier: BSD-3-Clause
 
 import os
+import re
 import sys
 import difflib
 from subprocess import Popen, PIPE
 
 
 VERBOSE = False
-TRACED_CALLS = ["os_malloc", "os_calloc", "os_realloc", "os_free", "brk", "mmap", "munmap"]
+TRACED_CALLS = ["os_malloc", "os_calloc", "os_realloc", "os_free", "os_memalign", "os_aligned_alloc",
+                "os_posix_memalign", "os_mallopt", "brk", "mmap", "munmap"]
+# Calls that return a number instead of an address
+VALUE_CALLS = ["os_posix_memalign", "os_malloc_usable_size", "os_malloc_batch", "os_malloc_trim",
+               "os_mallopt"]
 TESTS = {
     "test-malloc-no-preallocate": 2,
     "test-malloc-preallocate": 3,
@@ -49,6 +54,13 @@ TESTS = {
     "test-realloc-coalesce": 3,
     "test-realloc-coalesce-big": 1,
     "test-all": 5,
+    # Tests of the extended API, they must pass but are worth no points
+    "test-memalign": 0,
+    "test-free-sized": 0,
+    "test-malloc-batch": 0,
+    "test-malloc-trim": 0,
+    "test-mallopt": 0,
+    "test-calloc-mapped-reuse": 0,
 }
 
 
@@ -126,7 +138,23 @@ def pretty_mmap_args(mmap_syscall: SysCall):
     )))
 
 
+def main_thread_output(ltrace_output: str):
+    # Only keep the calls of the first thread, the others depend on how many CPUs there are
+    main_pid = None
+    lines = []
+    for line in ltrace_output.splitlines():
+        match = re.match(r"\[pid (\d+)\] ", line)
+        if match:
+            main_pid = main_pid or match.group(1)
+            if match.group(1) != main_pid:
+                continue
+            line = line[match.end():]
+        lines.append(line)
+    return "\n".join(lines)
+
+
 def parse_ltrace_output(ltrace_output: str):
+    ltrace_output = main_thread_output(ltrace_output)
     # Filter lines that do not contain traced calls
     lines = list(filter(
         lambda line: any(line.find(tc) != -1 for tc in TRACED_CALLS),
@@ -191,9 +219,20 @@ def parse_ltrace_output(ltrace_output: str):
             elif syscall.name == "brk" and syscall.ret not in heap_addresses:
                 heap_addresses[syscall.ret] = "HeapStart + " + \
                     hex(int(syscall.ret, 16) - heap_start)
+            # Parts of a mapping that are unmapped on their own
+            elif syscall.name == "munmap" and syscall.args[0] not in mapped_addresses and mapped_addresses:
+                key = min(
+                    (key for key, label in mapped_addresses.items()
+                     if "+" not in label and int(key, 16) <= int(syscall.args[0], 16)),
+                    key=lambda key: int(syscall.args[0], 16) - int(key, 16),
+                    default=None
+                )
+                if key:
+                    offset = int(syscall.args[0], 16) - int(key, 16)
+                    mapped_addresses[syscall.args[0]] = mapped_addresses[key] + f" + {hex(offset)}"
 
         # Return values
-        if libcall.ret not in ["<void>", "0"]:
+        if libcall.ret not in ["<void>", "0"] and libcall.name not in VALUE_CALLS:
             # Mapped addresses
             if any(s.name == "mmap" for s in libcall.syscalls):
                 key = min(
@@ -276,7 +315,7 @@ def run_test(test_name):
     env = os.environ.copy()
     src = os.environ.get("SRC_PATH", "../src")
     env["LD_LIBRARY_PATH"] = src
-    with Popen(["ltrace", "-F", ".ltrace.conf", "-S", "-x", "os_*", f"{executable}"], \
+    with Popen(["ltrace", "-f", "-F", ".ltrace.conf", "-S", "-x", "os_*", f"{executable}"], \
         stdout=PIPE, stderr=PIPE, env=env) as proc:
         _, stderr = proc.communicate()
 
@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+int main(void)
+{
+	void *prealloc_ptr, *ptr, *mapped_ptr;
+
+	prealloc_ptr = mock_preallocate();
+
+	/* Test a block that reuses a dirty block at the top of the heap and grows past it */
+	ptr = os_malloc_checked(inc_sz_sm[8]);
+	taint(ptr, inc_sz_sm[8]);
+	os_free(ptr);
+	ptr = os_calloc_checked(1, inc_sz_sm[9]);
+
+	/* Test a mapped block that was freed and taken again by calloc */
+	mapped_ptr = os_calloc_checked(1, inc_sz_md[0]);
+	taint(mapped_ptr, inc_sz_md[0]);
+	os_free(mapped_ptr);
+	mapped_ptr = os_calloc_checked(1, inc_sz_md[0]);
+	taint(mapped_ptr, inc_sz_md[0]);
+	os_free(mapped_ptr);
+
+	/* Test a smaller mapped block after a freed one */
+	mapped_ptr = os_malloc_checked(inc_sz_lg[0]);
+	taint(mapped_ptr, inc_sz_lg[0]);
+	os_free(mapped_ptr);
+	mapped_ptr = os_calloc_checked(1, inc_sz_lg[0] - inc_sz_md[0]);
+
+	/* Cleanup */
+	os_free(mapped_ptr);
+	os_free(ptr);
+	os_free(prealloc_ptr);
+
+	return 0;
+}
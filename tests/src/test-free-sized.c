@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+int main(void)
+{
+	void *prealloc_ptr, *ptrs[NUM_SZ_SM], *ptr;
+	size_t usable;
+
+	prealloc_ptr = mock_preallocate();
+	os_free(prealloc_ptr);
+
+	FAIL(os_malloc_usable_size(NULL) != 0, "DBG: os_malloc_usable_size of NULL is not 0");
+
+	/* Test usable sizes of heap blocks */
+	for (int i = 0; i < NUM_SZ_SM; i++) {
+		ptrs[i] = os_malloc_checked(inc_sz_sm[i]);
+		usable = os_malloc_usable_size(ptrs[i]);
+		FAIL(usable < (size_t)inc_sz_sm[i], "DBG: usable size is smaller than the requested size");
+		taint(ptrs[i], usable);
+	}
+
+	/* Test sized frees of heap blocks and their reuse */
+	for (int i = 0; i < NUM_SZ_SM; i++)
+		os_free_sized(ptrs[i], inc_sz_sm[i]);
+	for (int i = 0; i < NUM_SZ_SM; i++)
+		ptrs[i] = os_malloc_checked(inc_sz_sm[i]);
+
+	/* Test the usable size and sized free of a resized block */
+	ptrs[0] = os_realloc_checked(ptrs[0], 200);
+	FAIL(os_malloc_usable_size(ptrs[0]) < 200, "DBG: usable size is smaller than the resized size");
+	os_free_sized(ptrs[0], 200);
+
+	/* Test small blocks that are freed and taken again right away */
+	for (int i = 0; i < 3; i++) {
+		ptr = os_malloc_checked(16);
+		FAIL(os_malloc_usable_size(ptr) < 16, "DBG: usable size is smaller than the requested size");
+		os_free_sized(ptr, 16);
+	}
+
+	/* Test the usable size and sized free of a mapped block */
+	ptr = os_malloc_checked(inc_sz_lg[1]);
+	usable = os_malloc_usable_size(ptr);
+	FAIL(usable < (size_t)inc_sz_lg[1], "DBG: usable size is smaller than the requested size");
+	taint(ptr, usable);
+	os_free_sized(ptr, inc_sz_lg[1]);
+
+	/* Cleanup */
+	for (int i = 1; i < NUM_SZ_SM; i++)
+		os_free_sized(ptrs[i], inc_sz_sm[i]);
+
+	return 0;
+}
@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+#include "test-utils.h"
+
+#define BATCH_SM	16
+#define BATCH_LG	3
+#define BATCH_SZ	2000
+
+void check_batch(void **ptrs, size_t size, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		FAIL(ptrs[i] == NULL, "DBG: os_malloc_batch returned NULL on valid size");
+		for (size_t j = 0; j < i; j++)
+			FAIL(ptrs[i] < ptrs[j] + size && ptrs[j] < ptrs[i] + size, "DBG: batch blocks overlap");
+		taint(ptrs[i], size);
+	}
+}
+
+void *alloc_thread(void *ptrs)
+{
+	FAIL(os_malloc_batch(BATCH_SZ, BATCH_SM, ptrs) != BATCH_SM, "DBG: os_malloc_batch returned a short batch");
+	check_batch(ptrs, BATCH_SZ, BATCH_SM);
+
+	return NULL;
+}
+
+int main(void)
+{
+	void *prealloc_ptr, **ptrs_sm, **ptrs_lg, **ptrs_all, *first;
+	pthread_t thread;
+
+	prealloc_ptr = mock_preallocate();
+	os_free(prealloc_ptr);
+	ptrs_sm = os_malloc_checked(BATCH_SM * sizeof(void *));
+	ptrs_lg = os_malloc_checked(BATCH_LG * sizeof(void *));
+	ptrs_all = os_malloc_checked(2 * BATCH_SM * sizeof(void *));
+
+	/* Test short batches */
+	FAIL(os_malloc_batch(0, BATCH_SM, ptrs_sm) != 0, "DBG: os_malloc_batch returned blocks for a zero size");
+	FAIL(os_malloc_batch(100, 0, ptrs_sm) != 0, "DBG: os_malloc_batch returned blocks for a zero count");
+
+	/* Test a batch of heap blocks */
+	FAIL(os_malloc_batch(100, BATCH_SM, ptrs_sm) != BATCH_SM, "DBG: os_malloc_batch returned a short batch");
+	check_batch(ptrs_sm, 100, BATCH_SM);
+
+	/* Test a batch of blocks over the mmap threshold */
+	FAIL(os_malloc_batch(inc_sz_lg[0], BATCH_LG, ptrs_lg) != BATCH_LG, "DBG: os_malloc_batch returned a short batch");
+	check_batch(ptrs_lg, inc_sz_lg[0], BATCH_LG);
+
+	/* Test freeing heap blocks, mapped blocks and NULL in one batch */
+	for (int i = 0; i < BATCH_SM; i++)
+		ptrs_all[i] = ptrs_sm[i];
+	ptrs_all[BATCH_SM] = NULL;
+	for (int i = 0; i < BATCH_LG; i++)
+		ptrs_all[BATCH_SM + 1 + i] = ptrs_lg[i];
+	os_free_batch(ptrs_all, BATCH_SM + 1 + BATCH_LG);
+
+	/* Test heap blocks of two threads freed in one batch, the second one gets an arena of its own with more CPUs */
+	FAIL(os_malloc_batch(BATCH_SZ, BATCH_SM, ptrs_all) != BATCH_SM, "DBG: os_malloc_batch returned a short batch");
+	check_batch(ptrs_all, BATCH_SZ, BATCH_SM);
+	first = ptrs_all[0];
+	DIE(pthread_create(&thread, NULL, alloc_thread, ptrs_sm) != 0, "pthread_create");
+	DIE(pthread_join(thread, NULL) != 0, "pthread_join");
+
+	/* Interleave the threads, the blocks are sorted when they are freed */
+	for (int i = BATCH_SM - 1; i >= 0; i--) {
+		ptrs_all[2 * i + 1] = ptrs_sm[i];
+		ptrs_all[2 * i] = ptrs_all[i];
+	}
+	check_batch(ptrs_all, BATCH_SZ, 2 * BATCH_SM);
+	os_free_batch(ptrs_all, 2 * BATCH_SM);
+
+	/* Expect the freed blocks of the main thread to be reused */
+	FAIL(os_malloc_batch(BATCH_SZ, BATCH_SM, ptrs_all) != BATCH_SM, "DBG: os_malloc_batch returned a short batch");
+	FAIL(ptrs_all[0] != first, "DBG: freed batch blocks were not reused");
+
+	/* Cleanup */
+	os_free_batch(ptrs_all, BATCH_SM);
+	os_free(ptrs_sm);
+	os_free(ptrs_lg);
+	os_free(ptrs_all);
+
+	return 0;
+}
@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+int main(void)
+{
+	void *prealloc_ptr, *ptrs[4], *mapped_ptr;
+
+	/* Test a heap that was never used */
+	FAIL(os_malloc_trim(0) != 0, "DBG: os_malloc_trim released memory of an empty heap");
+
+	prealloc_ptr = mock_preallocate();
+	os_free(prealloc_ptr);
+
+	/* Expect the free top of the heap to be given back, but not the mapped block */
+	ptrs[0] = os_malloc_checked(inc_sz_sm[3]);
+	ptrs[1] = os_malloc_checked(inc_sz_md[2]);
+	mapped_ptr = os_malloc_checked(inc_sz_lg[0]);
+	os_free(ptrs[1]);
+	FAIL(os_malloc_trim(0) != 1, "DBG: os_malloc_trim didn't release the top of the heap");
+
+	/* Expect nothing else to be given back */
+	FAIL(os_malloc_trim(0) != 0, "DBG: os_malloc_trim released memory twice");
+
+	/* Expect the pages of a free block in the middle of the heap to be given back */
+	ptrs[1] = os_malloc_checked(inc_sz_md[1]);
+	ptrs[2] = os_malloc_checked(inc_sz_sm[3]);
+	os_free(ptrs[1]);
+	FAIL(os_malloc_trim(0) != 1, "DBG: os_malloc_trim didn't release a free block");
+
+	/* Test trimming down to a pad */
+	ptrs[3] = os_malloc_checked(inc_sz_md[2]);
+	os_free(ptrs[3]);
+	FAIL(os_malloc_trim(inc_sz_md[1]) != 1, "DBG: os_malloc_trim didn't release the top of the heap");
+	FAIL(os_malloc_trim(inc_sz_md[1]) != 0, "DBG: os_malloc_trim released memory twice");
+
+	/* Expect the heap to grow again */
+	ptrs[3] = os_malloc_checked(inc_sz_md[2]);
+
+	/* Cleanup */
+	os_free(mapped_ptr);
+	os_free(ptrs[0]);
+	os_free(ptrs[2]);
+	os_free(ptrs[3]);
+
+	return 0;
+}
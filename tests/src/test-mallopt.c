@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+int main(void)
+{
+	void *prealloc_ptr, *ptr;
+	struct os_malloc_stats *stats;
+	int dynamic;
+
+	prealloc_ptr = mock_preallocate();
+	os_free(prealloc_ptr);
+	stats = os_malloc_checked(sizeof(*stats));
+
+	/* Test the default tunables */
+	os_malloc_stats(stats);
+	FAIL(stats->mmap_threshold != MMAP_THRESHOLD, "DBG: wrong default mmap threshold");
+	FAIL(stats->trim_threshold != TRIM_THRESHOLD, "DBG: wrong default trim threshold");
+	FAIL(stats->top_pad != TOP_PAD, "DBG: wrong default top pad");
+
+	/* Test invalid parameters and values */
+	FAIL(os_mallopt(0, 1) != 0, "DBG: os_mallopt accepted an invalid parameter");
+	FAIL(os_mallopt(-1, 1) != 0, "DBG: os_mallopt accepted an invalid parameter");
+	FAIL(os_mallopt(OS_M_MMAP_THRESHOLD, 0) != 0, "DBG: os_mallopt accepted a zero threshold");
+	FAIL(os_mallopt(OS_M_MMAP_THRESHOLD, stats->mmap_threshold_max + 1) != 0,
+		 "DBG: os_mallopt accepted a threshold over its maximum");
+	FAIL(os_mallopt(OS_M_MMAP_THRESHOLD_MAX, MMAP_THRESHOLD - 1) != 0,
+		 "DBG: os_mallopt accepted a maximum under the threshold");
+
+	/* Expect the threshold to move above a mapped block once it is freed, if the build made it dynamic */
+	dynamic = stats->dynamic_threshold;
+	ptr = os_malloc_checked(inc_sz_lg[0]);
+	os_free(ptr);
+	os_malloc_stats(stats);
+	if (dynamic) {
+		FAIL(stats->mmap_threshold <= inc_sz_lg[0] + METADATA_SIZE, "DBG: mmap threshold didn't move");
+		FAIL(stats->trim_threshold != 2 * stats->mmap_threshold,
+			 "DBG: trim threshold didn't follow the mmap threshold");
+	} else {
+		FAIL(stats->mmap_threshold != MMAP_THRESHOLD, "DBG: fixed mmap threshold moved");
+		FAIL(stats->trim_threshold != TRIM_THRESHOLD, "DBG: trim threshold moved");
+	}
+
+	/* Expect a block of the same size to come from the heap if the threshold moved */
+	ptr = os_malloc_checked(inc_sz_lg[0]);
+	os_free(ptr);
+
+	/* Expect a threshold that was set to stay fixed */
+	FAIL(os_mallopt(OS_M_MMAP_THRESHOLD, MMAP_THRESHOLD / 2) != 1, "DBG: os_mallopt rejected a valid threshold");
+	ptr = os_malloc_checked(inc_sz_md[2]);
+	os_free(ptr);
+	os_malloc_stats(stats);
+	FAIL(stats->dynamic_threshold, "DBG: mmap threshold still follows the workload");
+	FAIL(stats->mmap_threshold != MMAP_THRESHOLD / 2, "DBG: mmap threshold moved after it was set");
+	FAIL(stats->trim_threshold != MMAP_THRESHOLD, "DBG: trim threshold didn't follow the mmap threshold");
+
+	/* Expect a trim threshold that was set to stay fixed */
+	FAIL(os_mallopt(OS_M_TRIM_THRESHOLD, 4 * MMAP_THRESHOLD) != 1, "DBG: os_mallopt rejected a valid trim threshold");
+	FAIL(os_mallopt(OS_M_MMAP_THRESHOLD, MMAP_THRESHOLD) != 1, "DBG: os_mallopt rejected a valid threshold");
+	FAIL(os_mallopt(OS_M_TOP_PAD, 0) != 1, "DBG: os_mallopt rejected a valid top pad");
+	os_malloc_stats(stats);
+	FAIL(stats->trim_threshold != 4 * MMAP_THRESHOLD, "DBG: trim threshold moved after it was set");
+	FAIL(stats->top_pad != 0, "DBG: top pad wasn't set");
+
+	/* Cleanup */
+	os_free(stats);
+
+	return 0;
+}
@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdint.h>
+#include "test-utils.h"
+
+#define IS_ALIGNED(ptr, alignment)	(((size_t)(ptr) & ((alignment) - 1)) == 0)
+
+void *os_memalign_checked(size_t alignment, size_t size)
+{
+	void *ptr = os_memalign(alignment, size);
+
+	FAIL(ptr == NULL, "DBG: os_memalign returned NULL on valid alignment");
+	FAIL(!IS_ALIGNED(ptr, alignment), "DBG: os_memalign returned unaligned memory");
+
+	return ptr;
+}
+
+int main(void)
+{
+	void *prealloc_ptr, *ptrs[4], **memptr, **mapptr;
+	struct block_meta *header;
+
+	prealloc_ptr = mock_preallocate();
+	os_free(prealloc_ptr);
+
+	/* Test invalid alignments */
+	errno = 0;
+	FAIL(os_memalign(0, 100) != NULL || errno != EINVAL, "DBG: os_memalign accepted a zero alignment");
+	errno = 0;
+	FAIL(os_memalign(48, 100) != NULL || errno != EINVAL, "DBG: os_memalign accepted a non power of two");
+	errno = 0;
+	FAIL(os_aligned_alloc(3, 100) != NULL || errno != EINVAL, "DBG: os_aligned_alloc accepted a non power of two");
+
+	/* Test sizes that can't be allocated */
+	FAIL(os_memalign(64, 0) != NULL, "DBG: os_memalign returned memory for a zero size");
+	errno = 0;
+	FAIL(os_memalign(64, SIZE_MAX - 64) != NULL || errno != ENOMEM, "DBG: os_memalign didn't fail with ENOMEM");
+
+	/* Test alignments on the heap */
+	ptrs[0] = os_memalign_checked(64, 100);
+	ptrs[1] = os_memalign_checked(256, 1000);
+	ptrs[2] = os_aligned_alloc(4096, 3000);
+	FAIL(!IS_ALIGNED(ptrs[2], 4096), "DBG: os_aligned_alloc returned unaligned memory");
+	for (int i = 0; i < 3; i++) {
+		header = ptrs[i] - sizeof(struct block_meta);
+		FAIL(GET_STATUS(header) != STATUS_ALLOC && GET_STATUS(header) != STATUS_ALIGNED,
+			 "DBG: small aligned block is not on the heap");
+	}
+
+	/* Test alignment of a mapped block */
+	ptrs[3] = os_memalign_checked(4096, 200 * MULT_KB);
+	header = ptrs[3] - sizeof(struct block_meta);
+	FAIL(GET_STATUS(header) != STATUS_MAPPED, "DBG: big aligned block is not mapped");
+
+	/* Test os_posix_memalign */
+	memptr = os_malloc_checked(sizeof(void *));
+	mapptr = os_malloc_checked(sizeof(void *));
+	FAIL(os_posix_memalign(memptr, 4, 100) != EINVAL, "DBG: os_posix_memalign accepted an alignment below a pointer");
+	FAIL(os_posix_memalign(memptr, 24, 100) != EINVAL, "DBG: os_posix_memalign accepted a non power of two");
+	FAIL(os_posix_memalign(memptr, 64, SIZE_MAX - 64) != ENOMEM, "DBG: os_posix_memalign didn't fail with ENOMEM");
+	FAIL(os_posix_memalign(memptr, 128, 0) != 0 || memptr[0] != NULL, "DBG: os_posix_memalign failed on a zero size");
+	FAIL(os_posix_memalign(memptr, 128, 500) != 0, "DBG: os_posix_memalign failed on valid alignment");
+	FAIL(!IS_ALIGNED(memptr[0], 128), "DBG: os_posix_memalign returned unaligned memory");
+	FAIL(os_posix_memalign(mapptr, 4096, 300 * MULT_KB) != 0, "DBG: os_posix_memalign failed on valid alignment");
+	FAIL(!IS_ALIGNED(mapptr[0], 4096), "DBG: os_posix_memalign returned unaligned memory");
+	header = mapptr[0] - sizeof(struct block_meta);
+	FAIL(GET_STATUS(header) != STATUS_MAPPED, "DBG: big aligned block is not mapped");
+
+	/* Cleanup */
+	for (int i = 0; i < 4; i++)
+		os_free(ptrs[i]);
+	os_free(memptr);
+	os_free(mapptr);
+
+	return 0;
+}
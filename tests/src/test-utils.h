@@ -52,6 +52,20 @@ void taint(void *ptr, size_t size)
 		memcpy(ptr + i, buf, MIN(4096, size - i));
 }
 
+/*
+ * The old block of a moved allocation is freed by os_realloc() and its payload
+ * may be reused for bookkeeping, so compare checksums taken before the call.
+ */
+unsigned long checksum(void *ptr, size_t size)
+{
+	unsigned long hash = 14695981039346656037UL;
+
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ ((unsigned char *)ptr)[i]) * 1099511628211UL;
+
+	return hash;
+}
+
 void *os_calloc_checked(size_t nmemb, size_t size)
 {
 	void *ptr = os_calloc(nmemb, size);
@@ -79,11 +93,13 @@ void *os_realloc_checked(void *ptr, size_t size)
 {
 	void *ptr_realloc;
 	struct block_meta oldBlock;
+	unsigned long oldSum;
 
 	if (!ptr)
 		return os_realloc(ptr, size);
 
 	memcpy(&oldBlock, ptr - sizeof(struct block_meta), sizeof(oldBlock));
+	oldSum = checksum(ptr, MIN(oldBlock.size, size));
 
 	ptr_realloc = os_realloc(ptr, size);
 
@@ -96,7 +112,7 @@ void *os_realloc_checked(void *ptr, size_t size)
 	}
 
 	if (oldBlock.status == STATUS_ALLOC)
-		FAIL(memcmp(ptr_realloc, ptr, MIN(oldBlock.size, size)) != 0, "DBG: os_realloc corrupted memory");
+		FAIL(checksum(ptr_realloc, MIN(oldBlock.size, size)) != oldSum, "DBG: os_realloc corrupted memory");
 
 	return ptr_realloc;
 }